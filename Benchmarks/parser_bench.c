@@ -0,0 +1,238 @@
+// parser_bench: Microbenchmark for the shell's lexer and expander. It links parse_input(),
+// expand_variable() and process_tokens() from Solution_Code/MyShell.c and feeds them
+// synthetic corpora:
+//   short     typical interactive commands ("ls -l /tmp", "cd ..", ...)
+//   args10k   one line with 10,000 arguments
+//   quoted    lines made of many double-quoted strings with embedded spaces
+//   vardense  lines where nearly every word is a $VAR reference
+// For every corpus and stage (parse_input alone, expand_variable over the parsed tokens,
+// and the full parse_input + process_tokens path the shell runs for external commands) it
+// reports ns/byte, ns/line, allocations and allocated bytes per line, and the peak live
+// heap. malloc/calloc/realloc/free are interposed to count allocations.
+//
+// Build and run from the repository root:
+//   gcc -O2 -DMYSHELL_NO_MAIN -o parser_bench Benchmarks/parser_bench.c Solution_Code/MyShell.c
+//   ./parser_bench [-t seconds_per_case] [-o file]
+// Results are printed as a table and appended to bench_output.txt (or -o file) as JSON lines.
+// No corpus uses $(...), so nothing is forked while measuring.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define CORPUS_LINES 64    // Lines per corpus (args10k uses one)
+
+// Functions under test, from MyShell.c.
+char **parse_input(const char *input);
+char *expand_variable(const char *token);
+char **process_tokens(char **tokens);
+void free_tokens(char **tokens);
+double now_seconds(void);
+
+// glibc's allocator entry points; the wrappers below forward to them.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+// Allocation counters, updated by the interposed allocator.
+struct {
+    long calls;            // malloc/calloc/realloc calls
+    long bytes;            // Bytes requested
+    long live;             // Bytes currently allocated (usable size)
+    long peak;             // Highest value of live
+} heap;
+
+// One synthetic input set.
+struct corpus {
+    const char *name;
+    char **lines;
+    int n_lines;
+    size_t bytes;          // Total input bytes
+};
+
+void build_corpus(struct corpus *c, const char *name);
+void run_case(FILE *out, const struct corpus *c, const char *stage, double seconds);
+void track_alloc(void *ptr, size_t request);
+
+//-------------------------------------------------------------
+// Interposed allocator: counts calls, requested bytes and live/peak heap.
+void *malloc(size_t size) {
+    void *p = __libc_malloc(size);
+    track_alloc(p, size);
+    return p;
+}
+
+void *calloc(size_t n, size_t size) {
+    void *p = __libc_calloc(n, size);
+    track_alloc(p, n * size);
+    return p;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr)
+        heap.live -= malloc_usable_size(ptr);
+    void *p = __libc_realloc(ptr, size);
+    track_alloc(p, size);
+    return p;
+}
+
+void free(void *ptr) {
+    if (ptr)
+        heap.live -= malloc_usable_size(ptr);
+    __libc_free(ptr);
+}
+
+//-------------------------------------------------------------
+// track_alloc: Records one successful allocation.
+void track_alloc(void *ptr, size_t request) {
+    if (!ptr)
+        return;
+    heap.calls++;
+    heap.bytes += request;
+    heap.live += malloc_usable_size(ptr);
+    if (heap.live > heap.peak)
+        heap.peak = heap.live;
+}
+
+//-------------------------------------------------------------
+// main: Builds the corpora and times every (corpus, stage) pair.
+int main(int argc, char **argv) {
+    static const char *corpora[] = { "short", "args10k", "quoted", "vardense" };
+    static const char *stages[] = { "parse_input", "expand_variable", "parse+process_tokens" };
+    double seconds = 0.5;
+    const char *output = "bench_output.txt";
+    int opt;
+    while ((opt = getopt(argc, argv, "t:o:")) != -1) {
+        if (opt == 't')
+            seconds = atof(optarg);
+        else if (opt == 'o')
+            output = optarg;
+        else {
+            fprintf(stderr, "usage: %s [-t seconds_per_case] [-o file]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    // Variables referenced by the vardense corpus.
+    setenv("HOME", "/home/bench", 1);
+    setenv("USER", "bench", 1);
+    setenv("PROJECT_DIR", "/srv/projects/example-project", 1);
+    setenv("FLAGS", "-O2 -Wall", 1);
+    setenv("N", "42", 1);
+
+    FILE *out = fopen(output, "a");
+    if (!out) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    printf("%-9s %-21s %9s %10s %11s %12s %10s\n",
+           "corpus", "stage", "ns/byte", "ns/line", "allocs/line", "bytes/line", "peak_heap");
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++) {
+        struct corpus corpus;
+        build_corpus(&corpus, corpora[c]);
+        for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); s++)
+            run_case(out, &corpus, stages[s], seconds);
+        for (int i = 0; i < corpus.n_lines; i++)
+            free(corpus.lines[i]);
+        free(corpus.lines);
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("max RSS: %ld KiB\n", ru.ru_maxrss);
+    fclose(out);
+    return 0;
+}
+
+//-------------------------------------------------------------
+// build_corpus: Generates the named corpus.
+void build_corpus(struct corpus *c, const char *name) {
+    static const char *short_cmds[] = {
+        "ls", "ls -l /tmp", "cd ..", "echo hello", "grep -n main MyShell.c", "cat /etc/hostname",
+        "mkdir test", "ls -a -l -h", "sleep 1 &", "export x=5",
+    };
+    static const char *vars[] = { "$HOME", "$USER", "$PROJECT_DIR/src", "$FLAGS", "x$N", "$UNSET" };
+    c->name = name;
+    c->n_lines = strcmp(name, "args10k") == 0 ? 1 : CORPUS_LINES;
+    c->lines = malloc(c->n_lines * sizeof(char *));
+    c->bytes = 0;
+    for (int i = 0; i < c->n_lines; i++) {
+        char *line = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&line, &len);
+        if (strcmp(name, "short") == 0) {
+            fputs(short_cmds[i % (sizeof(short_cmds) / sizeof(short_cmds[0]))], f);
+        } else if (strcmp(name, "args10k") == 0) {
+            fputs("touch", f);
+            for (int a = 0; a < 10000; a++)
+                fprintf(f, " file_%05d.txt", a);
+        } else if (strcmp(name, "quoted") == 0) {
+            fputs("printf", f);
+            for (int a = 0; a < 40; a++)
+                fprintf(f, " \"word %d with  spaces\"", a);
+        } else {
+            fputs("echo", f);
+            for (int a = 0; a < 40; a++)
+                fprintf(f, " %s", vars[a % (sizeof(vars) / sizeof(vars[0]))]);
+        }
+        fclose(f);
+        c->lines[i] = line;
+        c->bytes += len;
+    }
+}
+
+//-------------------------------------------------------------
+// run_case: Repeats one stage over the whole corpus for about 'seconds' and reports the
+// per-byte and per-line cost plus allocation statistics.
+void run_case(FILE *out, const struct corpus *c, const char *stage, double seconds) {
+    long passes = 0;
+    long calls0 = heap.calls, bytes0 = heap.bytes;
+    heap.peak = heap.live;
+    long base = heap.live;
+    double start = now_seconds(), elapsed;
+    do {
+        for (int i = 0; i < c->n_lines; i++) {
+            char **tokens = parse_input(c->lines[i]);
+            if (strcmp(stage, "expand_variable") == 0) {
+                for (int t = 0; tokens[t] != NULL; t++)
+                    free(expand_variable(tokens[t]));
+            } else if (strcmp(stage, "parse+process_tokens") == 0) {
+                free_tokens(process_tokens(tokens));
+            }
+            free_tokens(tokens);
+        }
+        passes++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < seconds);
+
+    // The parse_input stage of the same corpus runs first; its cost is subtracted from the
+    // expand_variable stage so that row shows the expansions alone.
+    static double parse_ns, parse_allocs, parse_bytes;
+    double lines = (double)passes * c->n_lines;
+    double ns_line = elapsed * 1e9 / lines;
+    double allocs = (heap.calls - calls0) / lines;
+    double bytes = (heap.bytes - bytes0) / lines;
+    if (strcmp(stage, "parse_input") == 0) {
+        parse_ns = ns_line;
+        parse_allocs = allocs;
+        parse_bytes = bytes;
+    } else if (strcmp(stage, "expand_variable") == 0) {
+        ns_line -= parse_ns;
+        allocs -= parse_allocs;
+        bytes -= parse_bytes;
+    }
+    double ns_byte = ns_line * c->n_lines / c->bytes;
+    long peak = heap.peak - base;
+
+    printf("%-9s %-21s %9.2f %10.0f %11.1f %12.0f %10ld\n", c->name, stage, ns_byte, ns_line,
+           allocs, bytes, peak);
+    fprintf(out, "{\"bench\":\"parser\",\"corpus\":\"%s\",\"stage\":\"%s\",\"lines\":%.0f,"
+            "\"bytes_per_line\":%.1f,\"ns_per_byte\":%.3f,\"ns_per_line\":%.1f,"
+            "\"allocs_per_line\":%.2f,\"alloc_bytes_per_line\":%.1f,\"peak_heap_bytes\":%ld,"
+            "\"timestamp\":%ld}\n",
+            c->name, stage, lines, (double)c->bytes / c->n_lines, ns_byte, ns_line, allocs, bytes,
+            peak, (long)time(NULL));
+}
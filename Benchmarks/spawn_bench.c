@@ -0,0 +1,245 @@
+// spawn_bench: Measures how long it takes to launch and reap one command with each of the
+// process-creation backends a shell can use, while the launching process holds a given
+// amount of dirty heap (fork has to copy its page tables, so this dominates at large RSS).
+//
+// Backends:
+//   fork_execvp   fork() + execvp() + waitpid(), exactly what execute_command() does
+//   vfork         vfork() + execvp(): the parent is suspended and memory is shared until exec
+//   posix_spawn   posix_spawnp(), which glibc implements with clone(CLONE_VM | CLONE_VFORK)
+//   clone3        raw clone3() with CLONE_VFORK | CLONE_PIDFD, reaped through the pidfd.
+//                 (Without CLONE_VM: sharing the stack needs an assembly trampoline, and
+//                 posix_spawn already measures that path.)
+//
+// Build and run from the repository root:
+//   gcc -O2 -o spawn_bench Benchmarks/spawn_bench.c
+//   ./spawn_bench [-n iterations] [-s rss_mb,rss_mb,...] [-o file] [command [args...]]
+// Defaults: 200 iterations, RSS sizes 1,16,256,1024,4096 MB, /bin/true, bench_output.txt.
+// Sizes that cannot be allocated are skipped. A table goes to stdout, and one JSON object per
+// (backend, rss) pair is appended to the output file for regression tracking.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <linux/sched.h>
+
+#define MAX_SIZES 16       // Maximum number of RSS sizes on the command line
+
+extern char **environ;
+
+// One process-creation backend: starts argv and returns once the child has been reaped.
+// Fills *spawned with the time taken until the launching call returned.
+struct backend {
+    const char *name;
+    int (*run)(char **argv, double *spawned);
+};
+
+double now_seconds(void);
+int run_fork_execvp(char **argv, double *spawned);
+int run_vfork(char **argv, double *spawned);
+int run_posix_spawn(char **argv, double *spawned);
+int run_clone3(char **argv, double *spawned);
+int compare_doubles(const void *a, const void *b);
+
+//-------------------------------------------------------------
+// main: Parses options, then for every RSS size dirties that much heap and times each
+// backend over the requested number of iterations.
+int main(int argc, char **argv) {
+    static const struct backend backends[] = {
+        { "fork_execvp", run_fork_execvp },
+        { "vfork", run_vfork },
+        { "posix_spawn", run_posix_spawn },
+        { "clone3", run_clone3 },
+    };
+    long sizes[MAX_SIZES] = { 1, 16, 256, 1024, 4096 };
+    int n_sizes = 5;
+    int iterations = 200;
+    const char *output = "bench_output.txt";
+    char *default_cmd[] = { "/bin/true", NULL };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+n:s:o:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 's':
+            n_sizes = 0;
+            for (char *tok = strtok(optarg, ","); tok && n_sizes < MAX_SIZES; tok = strtok(NULL, ","))
+                sizes[n_sizes++] = atol(tok);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-s mb,mb,...] [-o file] [command...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (iterations < 1)
+        iterations = 1;
+    char **cmd = optind < argc ? argv + optind : default_cmd;
+
+    FILE *out = fopen(output, "a");
+    if (!out) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    double *latency = malloc(iterations * sizeof(double));
+    double *spawn = malloc(iterations * sizeof(double));
+    if (!latency || !spawn) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-12s %8s %10s %10s %10s %10s %12s\n",
+           "backend", "rss_mb", "spawn_us", "p50_us", "p99_us", "mean_us", "cmds/sec");
+    for (int s = 0; s < n_sizes; s++) {
+        // Dirty the heap so every page is really resident (and must be mapped by fork).
+        size_t bytes = (size_t)sizes[s] << 20;
+        char *heap = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (heap == MAP_FAILED) {
+            fprintf(stderr, "skipping %ld MB: %s\n", sizes[s], strerror(errno));
+            continue;
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t off = 0; off < bytes; off += page)
+            heap[off] = 1;
+
+        for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+            double spawn_total = 0;
+            double t0 = now_seconds();
+            int failures = 0;
+            for (int i = 0; i < iterations; i++) {
+                double start = now_seconds();
+                spawn[i] = 0;
+                if (backends[b].run(cmd, &spawn[i]) != 0)
+                    failures++;
+                latency[i] = now_seconds() - start;
+                spawn_total += spawn[i];
+            }
+            double wall = now_seconds() - t0;
+            qsort(latency, iterations, sizeof(double), compare_doubles);
+            double p50 = latency[iterations / 2] * 1e6;
+            double p99 = latency[(int)(iterations * 0.99)] * 1e6;
+            double mean = wall / iterations * 1e6;
+            double spawn_mean = spawn_total / iterations * 1e6;
+
+            printf("%-12s %8ld %10.1f %10.1f %10.1f %10.1f %12.0f%s\n", backends[b].name, sizes[s],
+                   spawn_mean, p50, p99, mean, iterations / wall, failures ? "  (failures)" : "");
+            fprintf(out, "{\"bench\":\"spawn\",\"backend\":\"%s\",\"rss_mb\":%ld,\"command\":\"%s\","
+                    "\"iterations\":%d,\"failures\":%d,\"spawn_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,"
+                    "\"mean_us\":%.2f,\"cmds_per_sec\":%.1f,\"timestamp\":%ld}\n",
+                    backends[b].name, sizes[s], cmd[0], iterations, failures, spawn_mean, p50, p99,
+                    mean, iterations / wall, (long)time(NULL));
+            fflush(out);
+        }
+        munmap(heap, bytes);
+    }
+    fclose(out);
+    free(latency);
+    free(spawn);
+    return 0;
+}
+
+//-------------------------------------------------------------
+// now_seconds: Returns a monotonic timestamp in seconds.
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//-------------------------------------------------------------
+// run_fork_execvp: The shell's current launch path.
+int run_fork_execvp(char **argv, double *spawned) {
+    int status;
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    *spawned = now_seconds() - start;
+    if (waitpid(pid, &status, 0) < 0)
+        return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+//-------------------------------------------------------------
+// run_vfork: vfork() returns in the parent only after the child has exec'd (or exited).
+int run_vfork(char **argv, double *spawned) {
+    int status;
+    double start = now_seconds();
+    pid_t pid = vfork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    *spawned = now_seconds() - start;
+    if (waitpid(pid, &status, 0) < 0)
+        return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+//-------------------------------------------------------------
+// run_posix_spawn: posix_spawnp() with default attributes.
+int run_posix_spawn(char **argv, double *spawned) {
+    int status;
+    pid_t pid;
+    double start = now_seconds();
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+        return -1;
+    *spawned = now_seconds() - start;
+    if (waitpid(pid, &status, 0) < 0)
+        return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+//-------------------------------------------------------------
+// run_clone3: clone3() with CLONE_VFORK | CLONE_PIDFD; the child is reaped with
+// waitid(P_PIDFD), which is how a pidfd-based shell would do it.
+int run_clone3(char **argv, double *spawned) {
+    int pidfd = -1;
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_VFORK | CLONE_PIDFD;
+    args.pidfd = (uintptr_t)&pidfd;
+    args.exit_signal = SIGCHLD;
+
+    double start = now_seconds();
+    long pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    *spawned = now_seconds() - start;
+    siginfo_t info;
+    int rc = waitid(P_PIDFD, pidfd, &info, WEXITED);
+    close(pidfd);
+    if (rc < 0)
+        return -1;
+    return info.si_code == CLD_EXITED && info.si_status == 0 ? 0 : -1;
+}
+
+//-------------------------------------------------------------
+// compare_doubles: qsort() comparator for ascending doubles.
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
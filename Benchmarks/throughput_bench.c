@@ -0,0 +1,413 @@
+// throughput_bench: End-to-end commands/second of a shell in batch mode. A generated script
+// of N commands is piped into the shell's stdin (the way an orchestrator drives it) and the
+// whole read/parse/launch/reap loop is timed from the first byte written to the shell's exit.
+//
+// Workloads (each N lines):
+//   builtins    echo / export / cd, no children at all
+//   true        /bin/true in the foreground, one child per line
+//   bg_burst    bursts of 50 "/bin/true &" jobs separated by a foreground /bin/true
+//   cd_export   cd between directories while exporting and expanding variables
+//   mixed       a rotation of all of the above
+//
+// For MyShell the termination log is redirected with MYSHELL_LOG to a temporary file. Once
+// every expected child has a log line, /proc is scanned for zombie children of the shell
+// (there must be none) before stdin is closed. dash and bash (run on the same script when
+// installed) do not write a log, so only their wall time is reported; a final "wait" makes
+// them reap their background jobs before exiting too.
+//
+// Build and run from the repository root:
+//   gcc -O2 -o myshell Solution_Code/MyShell.c
+//   gcc -O2 -o throughput_bench Benchmarks/throughput_bench.c
+//   ./throughput_bench [-n commands] [-r repeats] [-o file] [-c shell,shell,...] [./myshell]
+// Defaults: 2000 commands, 3 repeats (the best run is reported), dash,bash as comparison
+// shells, bench_output.txt. A table goes to stdout and one JSON object per (shell, workload)
+// is appended to the output file.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <errno.h>
+
+#define MAX_SHELLS 8        // Maximum number of comparison shells
+#define BURST 50            // Background jobs per burst in bg_burst
+#define SETTLE_TIMEOUT 30.0 // Seconds to wait for MyShell to log every child
+
+// A generated workload: the script text and how many child processes it starts.
+struct workload {
+    const char *name;
+    char *script;
+    size_t len;
+    long children;
+};
+
+// The outcome of running one workload through one shell.
+struct run_result {
+    double wall;
+    long log_lines;         // -1 when the shell keeps no log
+    long zombies;           // -1 when not checked
+    int status;
+};
+
+double now_seconds(void);
+void build_workload(struct workload *w, int n, int is_posix);
+void append_line(struct workload *w, const char *line, long children);
+int run_shell(const char *shell, const struct workload *w, int is_myshell, const char *log_path,
+              struct run_result *result);
+long count_lines(const char *path);
+long count_zombies(pid_t parent);
+int find_in_path(const char *name, char *path, size_t size);
+
+//-------------------------------------------------------------
+// main: Parses options, builds every workload for MyShell and for the POSIX shells, and runs
+// each (shell, workload) pair the requested number of times.
+int main(int argc, char **argv) {
+    static const char *names[] = { "builtins", "true", "bg_burst", "cd_export", "mixed" };
+    int n_workloads = sizeof(names) / sizeof(names[0]);
+    int n = 2000;
+    int repeats = 3;
+    const char *output = "bench_output.txt";
+    char *compare = strdup("dash,bash");
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:o:c:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'c':
+            free(compare);
+            compare = strdup(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n commands] [-r repeats] [-o file] [-c shell,...] [myshell]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (n < 1)
+        n = 1;
+    if (repeats < 1)
+        repeats = 1;
+    const char *myshell = optind < argc ? argv[optind] : "./myshell";
+    if (access(myshell, X_OK) != 0) {
+        fprintf(stderr, "%s: not executable (build it with: gcc -O2 -o myshell Solution_Code/MyShell.c)\n", myshell);
+        return EXIT_FAILURE;
+    }
+
+    // The shells to run: MyShell first, then every comparison shell found in PATH.
+    char shells[MAX_SHELLS + 1][4096];
+    int n_shells = 0;
+    snprintf(shells[n_shells++], sizeof(shells[0]), "%s", myshell);
+    for (char *tok = strtok(compare, ","); tok && n_shells <= MAX_SHELLS; tok = strtok(NULL, ",")) {
+        if (*tok && find_in_path(tok, shells[n_shells], sizeof(shells[0])) == 0)
+            n_shells++;
+        else if (*tok)
+            fprintf(stderr, "skipping %s: not found in PATH\n", tok);
+    }
+
+    char log_path[] = "/tmp/throughput_bench_log.XXXXXX";
+    int log_fd = mkstemp(log_path);
+    if (log_fd < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(log_fd);
+
+    FILE *out = fopen(output, "a");
+    if (!out) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    // Writing to a shell that died must fail with EPIPE, not kill the driver.
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-10s %-10s %8s %10s %12s %9s %9s %8s\n",
+           "shell", "workload", "cmds", "wall_ms", "cmds/sec", "children", "log", "zombies");
+    for (int w = 0; w < n_workloads; w++) {
+        struct workload mine = { names[w], NULL, 0, 0 };
+        struct workload posix = { names[w], NULL, 0, 0 };
+        build_workload(&mine, n, 0);
+        build_workload(&posix, n, 1);
+
+        for (int s = 0; s < n_shells; s++) {
+            int is_myshell = s == 0;
+            const struct workload *wl = is_myshell ? &mine : &posix;
+            struct run_result best = { 0, -1, -1, 0 };
+            int failed = 0;
+            for (int r = 0; r < repeats; r++) {
+                struct run_result result;
+                if (run_shell(shells[s], wl, is_myshell, log_path, &result) != 0) {
+                    failed = 1;
+                    break;
+                }
+                if (r == 0 || result.wall < best.wall)
+                    best.wall = result.wall;
+                // Keep the worst accounting seen: a single leaked zombie is a failure.
+                if (r == 0 || result.zombies > best.zombies)
+                    best.zombies = result.zombies;
+                if (r == 0 || result.log_lines < best.log_lines)
+                    best.log_lines = result.log_lines;
+                if (result.status != 0)
+                    best.status = result.status;
+            }
+            if (failed)
+                continue;
+
+            const char *label = strrchr(shells[s], '/') ? strrchr(shells[s], '/') + 1 : shells[s];
+            char log_text[32] = "-", zombie_text[32] = "-";
+            if (best.log_lines >= 0)
+                snprintf(log_text, sizeof(log_text), "%ld", best.log_lines);
+            if (best.zombies >= 0)
+                snprintf(zombie_text, sizeof(zombie_text), "%ld", best.zombies);
+            int short_log = best.log_lines >= 0 && best.log_lines != wl->children;
+            printf("%-10s %-10s %8d %10.1f %12.0f %9ld %9s %8s%s%s\n", label, names[w], n,
+                   best.wall * 1e3, n / best.wall, wl->children, log_text, zombie_text,
+                   short_log ? "  (log mismatch)" : "", best.zombies > 0 ? "  (zombies!)" : "");
+            fprintf(out, "{\"bench\":\"throughput\",\"shell\":\"%s\",\"workload\":\"%s\",\"commands\":%d,"
+                    "\"repeats\":%d,\"wall_ms\":%.2f,\"cmds_per_sec\":%.1f,\"children\":%ld,"
+                    "\"log_lines\":%ld,\"zombies\":%ld,\"exit_status\":%d,\"timestamp\":%ld}\n",
+                    label, names[w], n, repeats, best.wall * 1e3, n / best.wall, wl->children,
+                    best.log_lines, best.zombies, best.status, (long)time(NULL));
+            fflush(out);
+        }
+        free(mine.script);
+        free(posix.script);
+    }
+    fclose(out);
+    unlink(log_path);
+    free(compare);
+    return 0;
+}
+
+//-------------------------------------------------------------
+// now_seconds: Returns a monotonic timestamp in seconds.
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//-------------------------------------------------------------
+// build_workload: Generates n command lines for w->name. The POSIX variant ends with "wait"
+// so dash and bash reap their background jobs before the clock stops.
+void build_workload(struct workload *w, int n, int is_posix) {
+    char line[128];
+    for (int i = 0; i < n; i++) {
+        int kind = 0;
+        int step = i;  // Position within the current kind's own rotation
+        if (strcmp(w->name, "true") == 0)
+            kind = 1;
+        else if (strcmp(w->name, "bg_burst") == 0)
+            kind = 2;
+        else if (strcmp(w->name, "cd_export") == 0)
+            kind = 3;
+        else if (strcmp(w->name, "mixed") == 0) {
+            kind = i % 4;
+            step = i / 4;
+        }
+
+        switch (kind) {
+        case 0:
+            // Builtins only: the cost of the prompt, the parser and the builtin dispatch.
+            switch (step % 3) {
+            case 0: snprintf(line, sizeof(line), "echo line %d $HOME\n", i); break;
+            case 1: snprintf(line, sizeof(line), "export B%d=%d\n", step % 64, i); break;
+            default: snprintf(line, sizeof(line), "cd /tmp\n"); break;
+            }
+            append_line(w, line, 0);
+            break;
+        case 1:
+            append_line(w, "/bin/true\n", 1);
+            break;
+        case 2:
+            // Bursts of BURST background jobs, then one foreground command.
+            append_line(w, step % (BURST + 1) == BURST ? "/bin/true\n" : "/bin/true &\n", 1);
+            break;
+        default:
+            switch (step % 4) {
+            case 0: snprintf(line, sizeof(line), "cd /usr\n"); break;
+            case 1: snprintf(line, sizeof(line), "export DIR%d=$PWD\n", step % 16); break;
+            case 2: snprintf(line, sizeof(line), "cd /tmp\n"); break;
+            default: snprintf(line, sizeof(line), "export LAST=$DIR%d\n", (step - 2) % 16); break;
+            }
+            append_line(w, line, 0);
+            break;
+        }
+    }
+    if (is_posix)
+        append_line(w, "wait\n", 0);
+}
+
+//-------------------------------------------------------------
+// append_line: Adds one line to the workload's script and accounts for its children.
+void append_line(struct workload *w, const char *line, long children) {
+    size_t add = strlen(line);
+    char *grown = realloc(w->script, w->len + add + 1);
+    if (!grown) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    w->script = grown;
+    memcpy(w->script + w->len, line, add + 1);
+    w->len += add;
+    w->children += children;
+}
+
+//-------------------------------------------------------------
+// run_shell: Starts shell with its stdin on a pipe and stdout/stderr on /dev/null, writes the
+// script and times everything up to the shell's exit. For MyShell the log is truncated first,
+// and before stdin is closed the driver waits until every child has been logged and counts
+// zombie children.
+int run_shell(const char *shell, const struct workload *w, int is_myshell, const char *log_path,
+              struct run_result *result) {
+    int fds[2];
+    if (is_myshell && truncate(log_path, 0) != 0) {
+        perror(log_path);
+        return -1;
+    }
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(fds[0], STDIN_FILENO);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        if (is_myshell)
+            setenv("MYSHELL_LOG", log_path, 1);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[0]);
+
+    size_t written = 0;
+    while (written < w->len) {
+        ssize_t r = write(fds[1], w->script + written, w->len - written);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: %s while writing the workload\n", shell, strerror(errno));
+            break;
+        }
+        written += r;
+    }
+
+    result->log_lines = -1;
+    result->zombies = -1;
+    if (is_myshell) {
+        // The shell is now idle at its prompt; wait for the last children to be reaped.
+        double deadline = now_seconds() + SETTLE_TIMEOUT;
+        while ((result->log_lines = count_lines(log_path)) < w->children && now_seconds() < deadline)
+            usleep(1000);
+        result->zombies = count_zombies(pid);
+    }
+    close(fds[1]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return -1;
+        }
+    }
+    result->wall = now_seconds() - start;
+    if (is_myshell)
+        result->log_lines = count_lines(log_path);
+    result->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 0;
+}
+
+//-------------------------------------------------------------
+// count_lines: Number of newline characters in path (0 if it cannot be read).
+long count_lines(const char *path) {
+    char buf[65536];
+    long lines = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) > 0)
+        for (ssize_t i = 0; i < r; i++)
+            lines += buf[i] == '\n';
+    close(fd);
+    return lines;
+}
+
+//-------------------------------------------------------------
+// count_zombies: Scans /proc for processes in state 'Z' whose parent is parent.
+long count_zombies(pid_t parent) {
+    DIR *proc = opendir("/proc");
+    if (!proc) {
+        perror("/proc");
+        return -1;
+    }
+    long zombies = 0;
+    struct dirent *entry;
+    while ((entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+            continue;
+        char path[300], buf[512];
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        ssize_t r = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (r <= 0)
+            continue;
+        buf[r] = '\0';
+        // Format: "pid (comm) state ppid ..."; comm may contain spaces, so start after ')'.
+        char *p = strrchr(buf, ')');
+        char state;
+        int ppid;
+        if (p && sscanf(p + 1, " %c %d", &state, &ppid) == 2 && ppid == parent && state == 'Z')
+            zombies++;
+    }
+    closedir(proc);
+    return zombies;
+}
+
+//-------------------------------------------------------------
+// find_in_path: Resolves a shell name through PATH (names containing '/' are used as is).
+int find_in_path(const char *name, char *path, size_t size) {
+    if (strchr(name, '/')) {
+        snprintf(path, size, "%s", name);
+        return access(path, X_OK);
+    }
+    const char *env = getenv("PATH");
+    char *dirs = strdup(env ? env : "/usr/bin:/bin");
+    char *save;
+    int rc = -1;
+    // strtok_r: main() is in the middle of its own strtok() over the shell list.
+    for (char *dir = strtok_r(dirs, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+        snprintf(path, size, "%s/%s", dir, name);
+        if (access(path, X_OK) == 0) {
+            rc = 0;
+            break;
+        }
+    }
+    free(dirs);
+    return rc;
+}
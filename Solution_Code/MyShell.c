@@ -1,70 +1,739 @@
+#define _GNU_SOURCE     // open_memstream, F_SETPIPE_SZ and other Linux extensions
 #include <stdio.h>      
 #include <stdlib.h>    
 #include <string.h>     
 #include <unistd.h>     
 #include <sys/types.h>  
 #include <sys/wait.h>   
+#include <sys/time.h>   
+#include <sys/resource.h>
 #include <signal.h>     
 #include <fcntl.h>     
 #include <errno.h>     
 #include <ctype.h>      
+#include <sys/mman.h>   
+#include <time.h>       
+#include <poll.h>       
+#include <sched.h>      
+#include <stdint.h>     
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <malloc.h>
+#include <linux/sched.h>
+#include <linux/mempolicy.h>
+#include <sys/timerfd.h>
 
 #define MAX_LINE 1024      // Maximum input length and buffer size
 #define INIT_TOKENS 100    // Initial capacity for tokens array
+#define SUBST_CHUNK 65536  // Minimum read size when capturing command substitution output
+#define SUBST_PIPE_SIZE (1 << 20)  // Requested pipe capacity for command substitution
+#define MAX_PASS_FDS 16    // Maximum process substitutions per command
+#define MAX_JOBS 256       // Capacity of the job table
+#define MAX_PERF_COUNTERS 8  // Counters pstat attaches to one command
+#define TRACE_CAPACITY 65536  // Spans kept by MYSHELL_TRACE; later ones are counted as dropped
+#define HIST_SUB_BITS 5    // Histogram sub-buckets per power of two: 2^5 = 32, about 3% resolution
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)  // Covers every uint64_t nanosecond value
+#define MAX_EVENT_SOURCES 16 // Extra descriptors the event loop watches (metrics, timeouts, PSI)
+#define MAX_METRICS_CLIENTS 4  // Concurrent scrapes; further connections are closed at once
+#define EXEC_FAILED 127    // Exit status of a child whose execvp() failed (as in sh)
+#define EXITLOG_MAGIC 0x4c584d53u  // "SMXL": marks every binary exit-log record
+#define EXITLOG_INDEX_STRIDE 1024  // Records per sparse time-index entry
+#define EXITLOG_UNTIL_SLACK_NS 60000000000LL  // How far out of order logq --until tolerates records
+#define CPU_MAX_PERIOD 100000  // cpu.max period (us) used by "limit cpu=N%"
+#define MAX_RLIMITS 8      // Resource limits one "ulimit ... -- cmd" can set for its command
+#define MAX_NUMA_NODES 64  // NUMA nodes the placement policy considers
+#define PSI_WINDOW_US 2000000  // PSI trigger window (a multiple of 2s, so unprivileged shells may use it)
+#define LOADCTL_INTERVAL_MS 250  // Sampling period of the adaptive maxjobs controller
+#define LOADCTL_HISTORY 16     // Recent limit changes kept for the loadctl builtin
+#define MAX_SUPERVISORS 16     // Commands "supervise" can keep running at once
+#define SUPERVISE_BACKOFF_MIN 0.5  // Seconds before the first restart
+#define SUPERVISE_BACKOFF_MAX 60.0 // Cap on the exponential restart delay
+#define SUPERVISE_HEALTHY 10.0     // A run this long (seconds) resets the backoff
+#define SUPERVISE_CRASH_LOOP 10    // Consecutive short runs that count as a crash loop (the
+                                   // backoff reaches SUPERVISE_BACKOFF_MAX before that)
+
+// Per-command launch attributes, applied by execute_command() in the child before exec.
+struct launch_attrs {
+    int stdin_fd;  // Descriptor to install as the child's stdin, or -1 to inherit the shell's.
+    int stdout_fd; // Descriptor to install as the child's stdout, or -1 to inherit the shell's.
+    int cpu;       // CPU to pin the child to with sched_setaffinity(), or -1 to inherit.
+    // Called in the parent right after fork(), while the child waits before exec, so the
+    // parent can attach to the child's PID (e.g. pstat's perf counters). NULL for none.
+    void (*on_launch)(pid_t pid, void *arg);
+    void *on_launch_arg;
+    int pass_fds[MAX_PASS_FDS];  // Pipe ends the child inherits for <(...) / >(...) (/dev/fd/N)
+    int n_pass_fds;
+    int cgroup_fd; // cgroup v2 directory the child starts in ("limit"), or -1 to inherit.
+    int nice;      // Niceness increment applied with nice() in the child ("nice"), 0 for none.
+    int policy;    // sched_setscheduler() policy for the child ("sched"), or -1 to inherit.
+    int priority;  // Static priority for SCHED_FIFO/SCHED_RR.
+    int has_affinity;     // 1 if affinity applies; it takes precedence over cpu.
+    cpu_set_t affinity;   // CPUs the child may run on ("affinity").
+    // Resource limits set with prlimit() in the child ("ulimit ... -- cmd").
+    struct {
+        int resource;
+        struct rlimit limit;
+    } rlimits[MAX_RLIMITS];
+    int n_rlimits;
+    int numa_node; // Node whose memory the child prefers (set_mempolicy), or -1 to inherit.
+    double timeout;     // Seconds until "timeout" sends SIGTERM, or 0 for no deadline.
+    double kill_after;  // Seconds from SIGTERM to SIGKILL ("timeout -k"), or 0 for never.
+    pid_t pgid;         // Process group to join (parallel's shared group), or 0 to lead a new one.
+};
+
+// Lifecycle of a job table entry.
+enum job_state { JOB_FREE, JOB_RUNNING, JOB_DONE };
+
+// Who is responsible for a job: a waiting caller, the user ('&'), or the shell itself
+// (helpers such as process substitutions). Only JOB_BACKGROUND counts toward maxjobs.
+enum job_kind { JOB_FOREGROUND, JOB_BACKGROUND, JOB_HELPER };
+
+// One child process started by the shell. Entries are added with SIGCHLD blocked and
+// marked JOB_DONE by on_child_exit(); the main loop releases finished background entries.
+struct job {
+    int id;                          // Job number (slot index + 1)
+    pid_t pid;                       // Process ID of the child
+    volatile sig_atomic_t state;     // enum job_state
+    int status;                      // Wait status, valid once state is JOB_DONE
+    int kind;                        // enum job_kind; non-foreground entries are released by reap_finished_jobs
+    double start;                    // now_seconds() at launch
+    double end;                      // now_seconds() when reaped, valid once state is JOB_DONE
+    int cpu;                         // CPU the job is pinned to, or -1
+    struct rusage usage;             // Resource usage from wait4(), valid once state is JOB_DONE
+    char *command;                   // Command text, for messages
+    int cgroup_fd;                   // Transient cgroup created by "limit" (removed on release), or -1
+    int numa_node;                   // NUMA node the job was placed on, or -1
+    int pid_fd;                      // pidfd for "timeout" signals to a job without its own group, or -1
+    double timeout, kill_after;      // From the launch attributes; 0 for none
+    double deadline;                 // now_seconds() when the next timeout signal is due, 0 for none
+    volatile sig_atomic_t timeout_signal;  // Last signal the timeout sent (0 if it never fired)
+    pid_t pgid;                      // Process group it runs in (its PID, or parallel's), or 0 if the shell's
+    volatile sig_atomic_t stopped;   // 1 while the job is stopped (SIGTSTP, SIGTTIN, SIGSTOP)
+    int supervisor;                  // Index + 1 of the "supervise" entry that restarts it, or 0
+    int restarts;                    // How many times the supervisor had restarted it before this run
+};
+
+struct job job_table[MAX_JOBS];
+
+// Job control: when the shell owns a terminal, every launched job leads its own process group
+// so it can be signalled and stopped as a unit, and foreground jobs get the terminal while they
+// run. In piped or batch use jobs stay in the shell's group, so ^C ends them with the shell.
+struct {
+    int terminal;                    // 1 if stdin is a terminal whose foreground group is the shell
+    int cgroup_kill;                 // "set cgkill=on": clear a limit job's cgroup when it ends
+} job_control;
+
+// Outcome of a finished child, as collected by wait_for_child().
+struct child_result {
+    int status;                      // Wait status (-1 if it could not be collected)
+    struct rusage usage;             // Resource usage reported by wait4()
+    double wall;                     // Seconds from launch to reap
+};
+
+struct child_result last_foreground; // Result of the most recent foreground command
+
+// Performance counters that pstat attaches to one command.
+struct perf_counters {
+    int hardware;                    // 1 if PMU counters are in use, 0 for the software fallback
+    int n;
+    int fd[MAX_PERF_COUNTERS];       // -1 where an individual event is unsupported
+    const char *name[MAX_PERF_COUNTERS];
+    uint64_t value[MAX_PERF_COUNTERS];  // Final counts, scaled for multiplexing
+};
+
+// A background command held back because maxjobs children are already running.
+struct queued_command {
+    char **argv;                     // Processed tokens to exec
+    struct launch_attrs attrs;       // Private copies of the command's descriptors
+    double enqueued;                 // now_seconds() when it was queued
+    struct queued_command *next;
+};
+
+// FIFO of queued commands.
+struct command_fifo {
+    struct queued_command *head, *tail;
+    int depth;
+};
+
+// Admission control for '&' commands: at most max_jobs run at once (0 = unlimited);
+// the rest wait in a FIFO that dispatch_job_queue() drains as slots free up.
+struct {
+    int max_jobs;
+    struct command_fifo pending;
+    long dispatched;                 // Commands that had to wait in the queue
+    double total_wait, max_wait;     // Seconds spent queued (sum and worst case)
+} job_queue;
+
+// One CPU's run queue in the CPU-affine scheduler.
+struct core_queue {
+    int cpu;                         // CPU number
+    struct command_fifo pending;     // Jobs assigned to this CPU, waiting for a free slot
+    long launched, stolen;           // Jobs started here, and how many were pulled from other queues
+    double busy;                     // Summed wall time of finished jobs pinned here
+    unsigned long long stat_busy, stat_total;  // /proc/stat jiffies when the scheduler was enabled
+};
+
+// CPU-affine scheduler ("set sched=cpu"): each '&' job is pinned to one CPU of the shell's
+// affinity mask, at most 'slots' jobs per CPU. Extra jobs wait in the least-loaded CPU's
+// queue, and a CPU with a free slot and an empty queue steals from the longest other queue.
+struct {
+    int enabled;
+    int slots;
+    int n_cores;
+    struct core_queue *cores;
+    double since;                    // now_seconds() when enabled
+} cpu_sched = { .slots = 1 };
+
+// How '&' jobs are spread over NUMA nodes ("set numa=...").
+enum numa_policy { NUMA_OFF, NUMA_ROUND_ROBIN, NUMA_LEAST_LOADED };
+
+// One NUMA node with CPUs, from /sys/devices/system/node.
+struct numa_node {
+    int id;
+    cpu_set_t cpus;
+};
+
+// NUMA placement: each placed job runs on one node's CPUs and prefers that node's memory,
+// so it does not allocate across the interconnect. The topology is read once, on first use.
+struct {
+    int policy;                      // enum numa_policy for '&' jobs
+    int loaded;                      // 1 once the topology has been read
+    int n_nodes;
+    struct numa_node nodes[MAX_NUMA_NODES];
+    int next;                        // Round-robin cursor into nodes
+} numa;
+
+// Deadlines of "timeout" jobs share one timerfd in the event loop, armed for the earliest
+// job_table deadline, so no watchdog process or per-job timer is needed.
+struct {
+    int fd;                          // CLOCK_MONOTONIC timerfd, created on first use; -1 before
+} timeouts = { .fd = -1 };
+
+// One /proc/pressure resource watched for admission control.
+struct psi_monitor {
+    const char *name;                // "memory" or "cpu"
+    int percent;                     // Stall threshold in % of PSI_WINDOW_US ("some"), 0 = off
+    int fd;                          // PSI trigger descriptor (POLLPRI when crossed), or -1
+    int pressured;                   // 1 from the trigger firing until a window below threshold
+    unsigned long long last_total;   // "some" total= (us) at the last check
+};
+
+// PSI-aware admission ("set psimem=N psicpu=N"): while a trigger reports stall time above the
+// threshold, background_slot_free() says no, so new '&' jobs wait in the queue. A timerfd then
+// re-reads the totals every window and releases the queue once the stall share drops.
+struct {
+    struct psi_monitor monitors[2];
+    int recheck_fd;                  // Periodic timerfd while pressured, or -1
+    double recheck_at;               // now_seconds() of the previous check
+    long holds;                      // Times admission was paused
+} psi = { { { "memory", 0, -1, 0, 0 }, { "cpu", 0, -1, 0, 0 } }, -1, 0, 0 };
+
+// One change of the adaptive limit, for the loadctl report.
+struct loadctl_decision {
+    double when;                     // now_seconds()
+    double runnable, loadavg;        // Smoothed procs_running and 1-minute load at that moment
+    int running, queued;             // '&' jobs running and waiting
+    int from, to;                    // maxjobs before and after
+    const char *reason;
+};
+
+// Adaptive maxjobs ("set maxjobs=auto"): an AIMD controller sampled from a timerfd every
+// LOADCTL_INTERVAL_MS. While the host's runnable tasks stay under target (per online CPU) and
+// jobs are waiting, the limit grows by one per sample; when they exceed it, the limit halves
+// (at most once per second, so one spike does not collapse it).
+struct {
+    int enabled;
+    int fd;                          // Sampling timerfd, or -1
+    double target;                   // Runnable tasks per online CPU to hold ("set loadtarget=")
+    int cpus;                        // Online CPUs when enabled
+    double runnable;                 // EWMA of procs_running, excluding the shell itself
+    double loadavg;                  // Last 1-minute load average
+    double last_decrease;            // now_seconds() of the last halving
+    long samples, increases, decreases;
+    struct loadctl_decision history[LOADCTL_HISTORY];
+    long n_history;                  // Decisions so far (the ring keeps the last LOADCTL_HISTORY)
+} loadctl = { .fd = -1, .target = 1.0 };
+
+// A command kept running by "supervise". Between runs it waits for next_start, which the
+// shared timerfd below fires.
+struct supervisor {
+    int active;                      // 1 while running or waiting to restart
+    char **argv;                     // Processed command
+    struct launch_attrs attrs;       // Prefix settings reused on every start (no descriptors)
+    int always;                      // 1: restart after any exit; 0: only after a failure
+    int max_restarts;                // Give up after this many restarts (0 = no limit)
+    int restarts;                    // Restarts so far
+    int short_runs;                  // Consecutive runs shorter than SUPERVISE_HEALTHY, any status
+    int stopping;                    // Set by kill or --stop: do not restart
+    pid_t pid;                       // Current child, or 0 while waiting
+    double next_start;               // now_seconds() of the pending restart, or 0
+};
+
+struct {
+    struct supervisor entries[MAX_SUPERVISORS];
+    int fd;                          // timerfd armed for the earliest next_start, or -1
+} supervision = { .fd = -1 };
+
+int sigchld_pipe[2] = { -1, -1 };    // Self-pipe: on_child_exit() wakes the event loop through it
+int log_fd = -1;                     // Termination log, opened once by setup_environment()
+
+// One finished span of the MYSHELL_TRACE timeline.
+struct trace_span {
+    const char *name;                // Phase (a string literal); NULL until the slot is filled
+    double start, end;               // now_seconds() timestamps
+    pid_t pid;                       // Child the span belongs to, or 0 for the shell itself
+};
+
+// MYSHELL_TRACE=file.json: spans collected in memory and written as Chrome trace events at
+// exit. on_child_exit() records spans too, so slots are claimed with an atomic increment
+// instead of a lock; a handler that interrupts a record simply takes the next slot.
+struct {
+    int fd;                          // Output file, or -1 when tracing is off
+    pid_t owner;                     // The shell's PID: forked children must not dump
+    struct trace_span *spans;        // TRACE_CAPACITY slots
+    unsigned long next;              // Slots claimed so far (may run past TRACE_CAPACITY)
+} trace = { .fd = -1 };
+
+// Log-bucketed (HDR-style) latency histogram in nanoseconds. Values below 2^HIST_SUB_BITS get
+// a bucket each; above that every power of two is split into 2^HIST_SUB_BITS equal buckets,
+// so a reported percentile is within about 3% of the recorded value. Fixed size: recording is
+// an index computation and two increments, with no allocation.
+struct histogram {
+    uint64_t count;
+    uint64_t max;                    // Largest value recorded, reported exactly
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// Always-on latency histograms, printed and reset by the "stats" builtin. All are updated
+// from the main loop (never from on_child_exit), so they need no locking.
+struct {
+    struct histogram spawn;          // Launch to fork() returning in the shell
+    struct histogram wall;           // Command launch to reap (foreground and '&' jobs)
+    struct histogram parse;          // parse_input() per command line
+    struct histogram reap;           // on_child_exit() reaping a child to the main loop releasing it
+    double since;                    // now_seconds() at the last reset (or when shell() started)
+} stats;
+
+// A descriptor the event loop watches besides stdin and the SIGCHLD pipe. The handler is
+// called from the main loop (never from a signal handler) with the poll() revents.
+struct event_source {
+    int fd;
+    short events;
+    void (*handler)(int fd, short revents, void *arg);
+    void *arg;
+};
+
+struct event_source event_sources[MAX_EVENT_SOURCES];
+int n_event_sources;
+
+// One connection to the metrics socket, buffered until its request is complete.
+struct metrics_client {
+    int fd;                          // -1 when the slot is free
+    size_t len;
+    char request[512];
+};
+
+// MYSHELL_METRICS=path: counters served in Prometheus text format on a Unix socket. The
+// reaped and log counters are updated by on_child_exit(), so every update uses an atomic add.
+struct {
+    unsigned long spawned;           // Children forked
+    unsigned long reaped;            // Children collected with wait4()
+    unsigned long failed_execs;      // Children whose execvp() failed (see collect_exec_result)
+    unsigned long log_bytes;         // Bytes written to the termination log
+    int listen_fd;                   // -1 when metrics are off
+    pid_t owner;                     // The shell's PID: only it removes the socket at exit
+    char *path;
+    struct metrics_client clients[MAX_METRICS_CLIENTS];
+} metrics = { .listen_fd = -1 };
+
+// One record of the binary exit log (MYSHELL_EXITLOG). Records are fixed-size (128 bytes) so
+// record n lives at offset n * sizeof(struct exit_record), and are appended in reap order,
+// which keeps the file nearly sorted by end_ns: realtime clock steps, and several shells
+// appending to one log, can put a record slightly out of order.
+struct exit_record {
+    uint32_t magic;                  // EXITLOG_MAGIC
+    int32_t pid;
+    int32_t status;                  // Raw wait status
+    uint32_t command_hash;           // FNV-1a of the full command text (0 if unknown)
+    int64_t start_ns, end_ns;        // CLOCK_REALTIME at launch and at reap
+    int64_t utime_us, stime_us;
+    int64_t maxrss_kb;
+    int64_t minflt, majflt, nvcsw, nivcsw;
+    int32_t timeout_ms;              // Deadline set with "timeout" (0 for none)
+    int32_t timeout_signal;          // Last signal the timeout sent: 0, SIGTERM or SIGKILL
+    char command[32];                // Command text, truncated and NUL-padded
+};
+_Static_assert(sizeof(struct exit_record) == 128, "exit log records are 128 bytes on disk");
+
+// Sparse time index (the log's path + ".idx"): one entry for every EXITLOG_INDEX_STRIDE-th
+// record, so a time-range query binary-searches a few KB instead of reading the whole log.
+struct exit_index_entry {
+    int64_t end_ns;                  // end_ns of that record
+    uint64_t record;                 // Record number in the log
+};
+
+// Heap numbers for one command line (or the worst seen over all lines).
+struct line_memstat {
+    uint64_t allocs;                 // malloc/calloc/realloc calls
+    uint64_t bytes;                  // Bytes requested
+    int64_t peak;                    // Highest live heap above the line's starting point
+    int64_t net;                     // Live heap at the end minus at the start (leak suspects)
+    long rss_kb;                     // Shell's resident set after the line
+};
+
+// Heap accounting ("set memstat=on"), kept by the malloc wrappers below. live counts only
+// blocks allocated since accounting was switched on (see memstat_blocks), so it starts at 0.
+struct {
+    int enabled;
+    int in_line;                     // 1 between memstat_begin_line() and memstat_end_line()
+    uint64_t allocs, frees, bytes;   // Totals while enabled
+    int64_t live, peak;              // Live heap (usable sizes) and its high-water mark
+    uint64_t line_allocs, line_bytes;  // Totals when the current line started
+    int64_t line_live;               // live when the current line started
+    long lines;                      // Lines measured
+    struct line_memstat last, worst;
+} memstat;
+
+// Addresses of the blocks counted in memstat.live, so freeing a block allocated before
+// accounting started (or by an unwrapped allocator) leaves live alone. An open-addressing
+// set with linear probing, in mmap'd memory so growing it never re-enters malloc.
+struct {
+    void **slots;                    // NULL marks an empty slot
+    size_t cap, count;               // cap is 0 or a power of two
+} memstat_blocks;
+
+// Open descriptors of the binary exit log, -1 when MYSHELL_EXITLOG is not set.
+struct {
+    int fd, index_fd;
+    char *path;                      // Absolute path of the log (logq's default)
+} exit_log = { .fd = -1, .index_fd = -1 };
+
+// cgroup v2 state for "limit": job cgroups are created as children of base, which is
+// MYSHELL_CGROUP if set, else the shell's own cgroup (it must be delegated to the user and,
+// since the shell lives in it, already have the needed controllers enabled for children).
+struct {
+    char *base;                      // NULL until the first "limit"
+    long created;                    // Job cgroups created so far (used in their names)
+} cgroups;
 
 // Function declarations
 void on_child_exit();                    // Reaps terminated child processes and logs them
 void setup_environment();                // Changes directory to HOME (used at startup)
 void shell();                            // Main shell loop: prints prompt (with current directory), reads input, processes commands
+void run_command(char **tokens, struct launch_attrs *attrs);  // Runs one parsed command (builtin or external)
 char **parse_input(const char *input);   // Splits the input string into tokens (handling quotes)
+char **parse_input_quoted(const char *input, char **quoted);  // Same, also flagging quoted tokens
 char *expand_variable(const char *token);  // Expands environment variables in a token (e.g., $HOME)
+size_t subst_length(const char *s);      // Length of a "$(...)" command substitution at the start of s
+char *command_substitution(const char *cmd, size_t *out_len);  // Runs cmd and returns its captured stdout
+char *capture_command_output(char **tokens, size_t *out_len);  // Forks a command with stdout on a pipe
 char **process_tokens(char **tokens);    // Processes tokens: expands variables and further splits tokens if needed
-void execute_shell_builtin(char **tokens);  // Executes built-in commands: cd, echo, export
-void execute_command(char **tokens, int bg);  // Executes external commands (foreground or background)
+int is_shell_builtin(const char *name);  // Returns 1 if name is a built-in command
+int is_output_builtin(const char *name);  // Returns 1 if a builtin only prints and changes no state
+void execute_shell_builtin(char **tokens, FILE *out, struct launch_attrs *attrs);  // Executes built-in commands
+void builtin_parallel(char **tokens, FILE *out, const struct launch_attrs *attrs);  // parallel: bounded fan-out
+void builtin_time(char **tokens, FILE *out, struct launch_attrs *attrs);  // time: rusage report for a command
+void builtin_pstat(char **tokens, FILE *out, struct launch_attrs *attrs);  // pstat: perf counters for a command
+void fput_json_string(const char *s, FILE *out);  // Writes s as a quoted, escaped JSON string
+void attach_perf_counters(pid_t pid, void *arg);  // on_launch hook: opens counters on the child
+int open_perf_counter(uint32_t type, uint64_t config, pid_t pid);  // perf_event_open() wrapper
+void execute_command(char **tokens, int bg, struct launch_attrs *attrs);  // Executes external commands (foreground or background)
+pid_t launch_command(char **tokens, int bg, const struct launch_attrs *attrs);  // Forks and records a child (SIGCHLD blocked)
+double now_seconds(void);                // Monotonic clock reading in seconds
+void init_launch_attrs(struct launch_attrs *attrs);  // Resets launch attributes to "inherit everything"
+int extract_here_input(char **tokens, char *quoted);  // Removes <<DELIM / <<< word from tokens and returns a sealed memfd
+char *read_heredoc_body(const char *delim, int strip_tabs, int expand, size_t *out_len);  // Reads lines up to delim
+int make_sealed_memfd(const char *data, size_t len);  // Copies data into a read-only memfd positioned at offset 0
+void log_child_termination(void);        // Appends a termination line to the log file (async-signal-safe)
+void free_tokens(char **tokens);         // Frees a NULL-terminated token array and its strings
+char *join_tokens(char **tokens);        // Joins tokens with single spaces into a new string
+void block_sigchld(sigset_t *old);       // Blocks SIGCHLD, saving the previous mask in old
+struct job *add_job(pid_t pid, const char *command, int kind);  // Records a child (SIGCHLD blocked)
+struct job *find_job(pid_t pid);         // Looks up a running/finished job by PID
+int wait_for_child(pid_t pid, struct job *job, const sigset_t *old, struct child_result *result);  // Waits for a child
+void release_job(struct job *job);       // Returns a job entry to the free pool
+void reap_finished_jobs(void);           // Releases background jobs that have finished
+void reap_supervised_jobs(void);         // Same, for supervised jobs only (safe during waits)
+void finish_background_job(struct job *job);  // Accounts, reschedules and releases one job
+void expand_process_substitutions(char **tokens, struct launch_attrs *attrs);  // <(...) and >(...) to /dev/fd/N
+pid_t spawn_substitution_process(const char *cmd, int target_fd, int pipe_end);  // Starts a <(...)/>(...) command
+void release_launch_attrs(struct launch_attrs *attrs);  // Closes the shell's copies of per-command descriptors
+void setup_event_loop(void);             // Creates the SIGCHLD self-pipe used by wait_for_input
+void wait_for_input(void);               // Event loop: services child exits until stdin is readable
+ssize_t read_input_line(char **line, size_t *cap);  // getline() equivalent on top of the event loop
+void wait_for_sigchld(const sigset_t *old);  // Sleeps until a child exits, then starts queued jobs
+int count_background_jobs(void);         // Number of running '&' jobs
+int job_group_busy(const struct job *job);  // 1 if another running job shares its process group
+void enqueue_command(char **tokens, struct launch_attrs *attrs);  // Holds a background command back
+void dispatch_job_queue(void);           // Starts queued commands while below maxjobs
+struct queued_command *make_queued_command(char **tokens, struct launch_attrs *attrs);  // Copies a command for later
+void fifo_push(struct command_fifo *fifo, struct queued_command *q);  // Appends to a command FIFO
+struct queued_command *fifo_pop(struct command_fifo *fifo);  // Removes the oldest command, or NULL
+void start_queued_command(struct queued_command *q, int cpu);  // Launches and frees a queued command
+int background_slot_free(void);          // 1 if maxjobs allows another '&' job
+int set_cpu_sched(int enable);           // Turns the CPU-affine scheduler on or off
+void schedule_on_core(char **tokens, struct launch_attrs *attrs);  // Places a '&' job on a CPU queue
+int count_core_jobs(int cpu);            // Running '&' jobs pinned to cpu
+int read_cpu_stat(int cpu, unsigned long long *busy, unsigned long long *total);  // /proc/stat jiffies
+void print_cpu_sched(FILE *out);         // Per-CPU queue and utilization report
+void builtin_set(char **tokens, FILE *out);  // set name=value: shell settings (maxjobs)
+void builtin_jobs(FILE *out);            // jobs: running jobs and the admission queue
+void setup_trace(void);                  // Enables MYSHELL_TRACE span recording
+double trace_clock(void);                // now_seconds() while tracing, 0 otherwise (skips the clock read)
+void trace_record(const char *name, double start, double end, pid_t pid);  // Stores a span (async-signal-safe)
+void dump_trace(void);                   // atexit handler: writes the spans as Chrome trace JSON
+void hist_record(struct histogram *h, double seconds);  // Adds one duration to a histogram
+uint64_t hist_percentile(const struct histogram *h, double q);  // Value (ns) at quantile q, 0..1
+void builtin_stats(FILE *out);           // stats: latency percentiles since the last reset
+int add_event_source(int fd, short events, void (*handler)(int, short, void *), void *arg);  // Watches fd
+void remove_event_source(int fd);        // Stops watching fd
+int fill_event_pollfds(struct pollfd *fds);  // Appends the event sources to a poll() array
+void service_event_sources(const struct pollfd *fds, int n);  // Calls handlers for ready sources
+void note_child_reaped(void);            // Updates the reap counter (async-signal-safe)
+void report_exec_failure(int fd);        // Child side: sends execvp()'s errno up the error pipe
+int collect_exec_result(int err_pipe[2]);  // Parent side: waits for exec, counts failures
+void setup_metrics(void);                // Listens on MYSHELL_METRICS if set
+void accept_metrics_client(int fd, short revents, void *arg);  // Event handler: new scrape
+void serve_metrics_client(int fd, short revents, void *arg);   // Event handler: request data
+void write_metrics(FILE *out);           // Prometheus text exposition of the counters
+void remove_metrics_socket(void);        // atexit handler: unlinks the socket
+void setup_exit_log(void);               // Opens MYSHELL_EXITLOG and its index if set
+uint32_t hash_command(const char *command);  // FNV-1a hash of a command's text
+void append_exit_record(pid_t pid, int status, const struct rusage *usage, const struct job *job);  // Async-signal-safe
+void builtin_logq(char **tokens, FILE *out);  // logq: filters and aggregates the binary exit log
+int parse_log_time(const char *text, int64_t *ns);  // Epoch seconds or -N[smhd] relative to now
+void count_allocation(void *ptr, size_t request);  // Counts one allocation (memstat)
+size_t block_slot(const void *ptr);      // Home slot of a block address in memstat_blocks
+int track_block(void *ptr);              // Adds a counted block to memstat_blocks
+int untrack_block(void *ptr);            // Removes a block; 1 if it was counted
+void clear_tracked_blocks(void);         // Forgets every counted block (memstat switched on)
+void memstat_begin_line(void);           // Snapshots the heap counters before a command line
+void memstat_end_line(const char *line); // Computes (and reports) the line's heap numbers
+long read_rss_kb(void);                  // Shell's current resident set from /proc/self/statm
+void builtin_memstat(FILE *out);         // memstat: heap and RSS accounting report
+void builtin_limit(char **tokens, FILE *out, struct launch_attrs *attrs);  // limit: run a command in a cgroup
+void builtin_launch_prefix(char **tokens, FILE *out, struct launch_attrs *attrs);  // affinity/nice/sched prefixes
+int is_launch_prefix(const char *name);  // 1 for builtins that take a command to launch (prefixes, time, ...)
+int parse_cpu_list(const char *text, cpu_set_t *set);  // "0-3,6" into a CPU set
+void builtin_ulimit(char **tokens, FILE *out, struct launch_attrs *attrs);  // ulimit: shell or per-command limits
+pid_t fork_into_cgroup(int cgroup_fd);   // fork() whose child starts in the given cgroup
+const char *cgroup_base(void);           // Directory that job cgroups are created under
+int enable_cgroup_controllers(const char *base, const char *wanted);  // Writes cgroup.subtree_control
+int write_cgroup_file(int dir_fd, const char *name, const char *value);  // One value into a cgroup file
+void finish_job_cgroup(struct job *job); // Reports memory.peak/cpu.stat and removes the cgroup
+void remove_drained_cgroup(int fd, short revents, void *arg);  // Event handler: rmdir once emptied
+void release_untracked_cgroup(int cgroup_fd);  // Removes an untracked child's cgroup once it empties
+int load_numa_topology(void);            // Reads NUMA nodes and their CPUs from sysfs
+int pick_numa_node(void);                // Node for the next '&' job under the placement policy
+int find_numa_node(int id);              // Index in numa.nodes of a node ID, or -1
+int read_cpu_list_file(const char *path, cpu_set_t *set);  // sysfs "0-3,8" list file into a set
+int count_numa_jobs(int node);           // Running jobs placed on a node
+void place_on_numa_node(struct launch_attrs *attrs, int index);  // Binds a launch to a node
+void print_numa_nodes(FILE *out);        // Per-node CPUs and job counts
+void builtin_timeout(char **tokens, FILE *out, struct launch_attrs *attrs);  // timeout: deadline for a command
+int parse_duration(const char *text, double *seconds);  // "30s", "1.5m", "2h", "1d" or plain seconds
+void start_job_timeout(struct job *job, double timeout, double kill_after);  // Opens the pidfd, arms the timer
+void arm_timeout_timer(void);            // Sets the timerfd to the earliest job deadline
+void expire_timeouts(int fd, short revents, void *arg);  // Event handler: signals overdue jobs
+int psi_pressured(void);                 // 1 while a PSI monitor holds back '&' jobs
+int set_psi_threshold(struct psi_monitor *m, int percent);  // (Re)registers a PSI trigger
+unsigned long long read_psi_total(const char *name);  // "some" stall total (us) of a resource
+void on_psi_trigger(int fd, short revents, void *arg);  // Event handler: threshold crossed
+void recheck_psi(int fd, short revents, void *arg);     // Event handler: has pressure eased?
+void setup_job_control(void);            // Detects an interactive terminal for job control
+int set_adaptive_jobs(int enable);       // Starts or stops the AIMD maxjobs controller
+void sample_load(int fd, short revents, void *arg);  // Event handler: one controller step
+int read_load(double *runnable, double *loadavg);  // procs_running and the 1-minute load
+void builtin_loadctl(FILE *out);         // loadctl: controller state and recent decisions
+void builtin_supervise(char **tokens, FILE *out, struct launch_attrs *attrs);  // supervise: restart on exit
+void start_supervised(struct supervisor *sup);  // Launches one run of a supervised command
+void supervised_job_exited(struct job *job);   // Decides whether and when to restart (SIGCHLD blocked)
+void end_supervision(struct supervisor *sup, const char *why);  // Frees an entry with a message
+void arm_supervision_timer(void);        // Sets the timerfd to the earliest pending restart
+void restart_due_supervised(int fd, short revents, void *arg);  // Event handler: starts due restarts
+int signal_job(struct job *job, int sig);  // Signals a job's whole process group (and cgroup)
+void builtin_kill(char **tokens);        // kill [-SIG] %JOB|PID...
+int parse_signal(const char *name);      // "TERM", "SIGTERM" or "15" to a signal number
 
 //-------------------------------------------------------------
 // Main function: Registers the SIGCHLD handler, sets up the environment,
 // then enters the shell's interactive loop.
+// Building with -DMYSHELL_NO_MAIN leaves it out so benchmarks can link the shell's functions.
+#ifndef MYSHELL_NO_MAIN
 int main() {
+    // Create the self-pipe through which the SIGCHLD handler wakes the input loop.
+    setup_event_loop();
+    // Start recording spans if MYSHELL_TRACE names an output file (before the chdir to "/").
+    setup_trace();
+    // Serve metrics on a Unix socket if MYSHELL_METRICS names one.
+    setup_metrics();
+    // Append binary exit records if MYSHELL_EXITLOG names a log file.
+    setup_exit_log();
     // Set up the signal handler for SIGCHLD to handle background processes exiting.
     signal(SIGCHLD, on_child_exit);
+    // Hand the terminal to foreground jobs if the shell is interactive.
+    setup_job_control();
     // Set the initial environment; currently, this changes the directory to "/" (or HOME as needed).
     setup_environment();
     // Enter the shell loop which handles user commands continuously.
     shell();
     return 0;
 }
+#endif
+
+//-------------------------------------------------------------
+// Allocator wrappers for "set memstat=on": malloc/calloc/realloc/free and the aligned entry
+// points forward to glibc's own and, while accounting is on, count calls, requested bytes and
+// live heap. Only blocks counted while on are subtracted again when freed. When it is off (and
+// no counted block is left) they cost a branch or two. Building with -DMYSHELL_NO_MAIN leaves
+// them out too: the benchmarks that link the shell's functions interpose the allocator themselves.
+#ifndef MYSHELL_NO_MAIN
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    void *p = __libc_malloc(size);
+    if (memstat.enabled)
+        count_allocation(p, size);
+    return p;
+}
+
+void *calloc(size_t n, size_t size) {
+    void *p = __libc_calloc(n, size);
+    if (memstat.enabled)
+        count_allocation(p, n * size);
+    return p;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!memstat.enabled && memstat_blocks.count == 0)
+        return __libc_realloc(ptr, size);
+    size_t old = ptr ? malloc_usable_size(ptr) : 0;
+    void *p = __libc_realloc(ptr, size);
+    if ((p || size == 0) && ptr && untrack_block(ptr))
+        memstat.live -= old;  // The old block is gone (moved, resized or freed).
+    if (memstat.enabled)
+        count_allocation(p, size);
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *p = __libc_memalign(alignment, size);
+    if (memstat.enabled)
+        count_allocation(p, size);
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void *p = memalign(alignment, size);
+    if (!p)
+        return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+void free(void *ptr) {
+    if (ptr && memstat_blocks.count > 0) {
+        size_t size = malloc_usable_size(ptr);
+        if (untrack_block(ptr))
+            memstat.live -= size;
+    }
+    if (memstat.enabled && ptr)
+        memstat.frees++;
+    __libc_free(ptr);
+}
+#endif
 
 //-------------------------------------------------------------
 // on_child_exit: A signal handler for SIGCHLD that performs cleanup of terminated child processes.
-// It uses a non-blocking wait (WNOHANG) and logs each termination to a file ("log.txt").
+// It uses a non-blocking wait (WNOHANG), records the exit status in the job table
+// and logs each termination to a file ("log.txt"). Stops and continues only update the job.
 void on_child_exit() {
     int saved_errno = errno;  // Preserve errno to avoid side-effects during signal handling.
     pid_t pid;
     int status;
-    // Loop to reap all child processes that have terminated.
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    struct rusage usage;
+    // Loop to reap all child processes that have terminated (wait4 also returns their rusage).
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        // Hand the status to whoever tracks this child (foreground wait or job table).
+        struct job *job = find_job(pid);
+        if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+            if (job) {
+                job->stopped = WIFSTOPPED(status);
+                if (job->stopped)
+                    job->status = status;
+            }
+            continue;
+        }
+        if (job) {
+            job->status = status;
+            job->usage = usage;
+            job->end = now_seconds();  // clock_gettime() is async-signal-safe.
+            job->state = JOB_DONE;
+            // Launch (just before fork) to reap: the child's whole exec-to-exit lifetime.
+            trace_record("exec_to_exit", job->start, job->end, pid);
+        }
+        note_child_reaped();
+        double log_start = trace_clock();
+        log_child_termination();
+        append_exit_record(pid, status, &usage, job);
+        trace_record("log_write", log_start, trace_clock(), pid);
+    }
+    // Wake the event loop so it can release finished jobs and start queued ones.
+    if (sigchld_pipe[1] >= 0)
+        write(sigchld_pipe[1], "", 1);
+    errno = saved_errno;  // Restore the original errno value.
+}
+
+//-------------------------------------------------------------
+// log_child_termination: Appends a line to the log file ("log.txt") for one terminated child.
+// Only async-signal-safe calls are used so it can run inside on_child_exit.
+// The descriptor opened at startup is reused; if that failed, the file is opened per call
+// relative to the current directory as before.
+void log_child_termination(void) {
+    const char *msg = "Child process was terminated\n";
+    ssize_t written = -1;
+    if (log_fd >= 0) {
+        written = write(log_fd, msg, strlen(msg));
+    } else {
         // Open log file in append mode, creating it if it doesn't exist.
         int fd = open("log.txt", O_WRONLY | O_CREAT | O_APPEND, 0644);
         if (fd != -1) {
-            const char *msg = "Child process was terminated\n";
             // Write a log message about the terminated child process.
-            write(fd, msg, strlen(msg));
+            written = write(fd, msg, strlen(msg));
             close(fd);
         }
     }
-    errno = saved_errno;  // Restore the original errno value.
+    if (written > 0)
+        __atomic_fetch_add(&metrics.log_bytes, written, __ATOMIC_RELAXED);
 }
 
 //-------------------------------------------------------------
 // setup_environment: Prepares the initial environment for the shell.
 // Currently, it attempts to change the working directory to "/".
+// It then opens the termination log once, so later cd commands do not scatter "log.txt"
+// across directories and reaping a child costs one write() instead of open+write+close.
+// MYSHELL_LOG names a different log file (relative paths are taken from "/").
 // Future modifications could extend this to further environment settings.
 void setup_environment() {
     if (chdir("/") != 0) {
         // If chdir fails, print an error message.
         perror("chdir");
     }
+    const char *path = getenv("MYSHELL_LOG");
+    log_fd = open(path && *path ? path : "log.txt", O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
 }
 
 //-------------------------------------------------------------
@@ -72,12 +741,15 @@ void setup_environment() {
 // It displays a prompt (including the current directory), reads user input,
 // processes commands (built-in and external), and handles background execution.
 void shell() {
-    char input[MAX_LINE];
-    int ret;
+    char *input = NULL;
+    size_t input_cap = 0;
+    ssize_t ret;
+    stats.since = now_seconds();
     
     // Infinite loop to continuously prompt and process commands.
     while (1) {
         // Retrieve and display the current working directory in the prompt.
+        double span = trace_clock();
         {
             char cwd[MAX_LINE];
             if(getcwd(cwd, sizeof(cwd)) != NULL)
@@ -87,108 +759,160 @@ void shell() {
                 printf("myshell> ");
             fflush(stdout);  // Flush the output to ensure prompt appears immediately.
         }
+        trace_record("prompt", span, trace_clock(), 0);
        
-        // Read user input up to 1023 characters or until a newline is encountered.
-        ret = scanf("%1023[^\n]", input);
-        if(ret != 1) {
-            // If no valid input is read (e.g., user just pressed Enter), consume the newline.
-            getchar();
-            continue;
-        }
-        getchar();  // Consume the newline character left by scanf.
+        // Read one line of user input; background jobs are serviced while waiting.
+        span = trace_clock();
+        ret = read_input_line(&input, &input_cap);
+        trace_record("read", span, trace_clock(), 0);
+        if(ret < 0)
+            break;  // End of input behaves like "exit".
+        if(ret > 0 && input[ret-1] == '\n')
+            input[--ret] = '\0';  // Drop the newline.
         // If the input is an empty string, continue to the next iteration (re-prompt).
         if(strlen(input) == 0)
             continue;
         
+        // Release background jobs (including process substitutions) that have finished.
+        reap_finished_jobs();
+        memstat_begin_line();
+
         // Tokenize the input string into individual arguments/words.
-        char **tokens = parse_input(input);
-        if(tokens[0] == NULL) {
+        span = now_seconds();
+        char *quoted;
+        char **tokens = parse_input_quoted(input, &quoted);
+        double parsed = now_seconds();
+        hist_record(&stats.parse, parsed - span);
+        trace_record("parse_input", span, parsed, 0);
+        // Pull out here-documents/here-strings; their body lines are consumed even if unused.
+        struct launch_attrs attrs;
+        init_launch_attrs(&attrs);
+        attrs.stdin_fd = extract_here_input(tokens, quoted);
+        free(quoted);
+        if(tokens[0] == NULL || attrs.stdin_fd == -2) {
             // If tokenization results in no tokens, free the tokens array and re-prompt.
-            free(tokens);
+            release_launch_attrs(&attrs);
+            free_tokens(tokens);
+            memstat_end_line(input);
             continue;
         }
         
         // If the user enters "exit", clean up allocated memory and break out of the loop.
         if(strcmp(tokens[0], "exit") == 0) {
-            for (int i = 0; tokens[i] != NULL; i++)
-                free(tokens[i]);
-            free(tokens);
+            release_launch_attrs(&attrs);
+            free_tokens(tokens);
             break;
         }
         
-        // Check if the command is a built-in command (cd, echo, or export).
-        if(strcmp(tokens[0], "cd") == 0 ||
-           strcmp(tokens[0], "echo") == 0 ||
-           strcmp(tokens[0], "export") == 0) {
-            // Execute the built-in command without forking a new process.
-            execute_shell_builtin(tokens);
-            // Free memory allocated for tokens before continuing.
-            for (int i = 0; tokens[i] != NULL; i++)
-                free(tokens[i]);
-            free(tokens);
-            continue;
-        }
-        
-        // Process tokens to expand any environment variables and split tokens with whitespace.
-        char **processed_tokens = process_tokens(tokens);
-        // Free the original tokens after processing.
-        for (int i = 0; tokens[i] != NULL; i++)
-            free(tokens[i]);
-        free(tokens);
-        
-        // Check if the command should run in the background.
-        int bg = 0;
-        int count = 0;
-        while (processed_tokens[count] != NULL)
-            count++;
-        if (count > 0 && strcmp(processed_tokens[count-1], "&") == 0) {
-            bg = 1;  // Background flag set if last token is "&".
-            free(processed_tokens[count-1]);  // Remove the "&" token.
-            processed_tokens[count-1] = NULL;
-        }
-        
-        // Execute the external command using the processed tokens.
-        execute_command(processed_tokens, bg);
-        
-        // Free the memory allocated for the processed tokens.
-        for (int i = 0; processed_tokens[i] != NULL; i++)
-            free(processed_tokens[i]);
-        free(processed_tokens);
+        run_command(tokens, &attrs);
+        release_launch_attrs(&attrs);  // The child (or the queue) holds its own copies.
+        free_tokens(tokens);
+        memstat_end_line(input);
+    }
+    free(input);
+}
+
+//-------------------------------------------------------------
+// run_command: Runs one tokenized command line: builtins in the shell process, everything
+// else through execute_command() after process substitution and variable expansion.
+// A trailing "&" runs an external command in the background. The caller still owns
+// tokens and attrs and releases them afterwards.
+void run_command(char **tokens, struct launch_attrs *attrs) {
+    // Check if the command is a built-in command (cd, echo, export, ...).
+    if(is_shell_builtin(tokens[0])) {
+        // Execute the built-in command without forking a new process.
+        double start = trace_clock();
+        execute_shell_builtin(tokens, stdout, attrs);
+        fflush(stdout);
+        trace_record("builtin", start, trace_clock(), 0);
+        return;
+    }
+    
+    // Start the producers/consumers of <(...) and >(...) and substitute /dev/fd paths.
+    expand_process_substitutions(tokens, attrs);
+    // Process tokens to expand any environment variables and split tokens with whitespace.
+    double start = trace_clock();
+    char **processed_tokens = process_tokens(tokens);
+    trace_record("process_tokens", start, trace_clock(), 0);
+    
+    // Check if the command should run in the background.
+    int bg = 0;
+    int count = 0;
+    while (processed_tokens[count] != NULL)
+        count++;
+    if (count > 0 && strcmp(processed_tokens[count-1], "&") == 0) {
+        bg = 1;  // Background flag set if last token is "&".
+        free(processed_tokens[count-1]);  // Remove the "&" token.
+        processed_tokens[count-1] = NULL;
     }
+    
+    // Execute the external command using the processed tokens.
+    if (processed_tokens[0] != NULL)
+        execute_command(processed_tokens, bg, attrs);
+    
+    // Free the memory allocated for the processed tokens.
+    free_tokens(processed_tokens);
 }
 
 //-------------------------------------------------------------
 // parse_input: Splits the input string into an array of tokens (words) based on spaces/tabs.
 // It respects text enclosed in double quotes to ensure that quoted strings are treated as one token.
 char **parse_input(const char *input) {
+    return parse_input_quoted(input, NULL);
+}
+
+//-------------------------------------------------------------
+// parse_input_quoted: parse_input() that, if quoted is not NULL, also returns in *quoted a
+// malloc'd array with one flag per token: 1 if the token's first character was inside double
+// quotes. Operators such as "<<" are only recognised in tokens whose flag is 0.
+char **parse_input_quoted(const char *input, char **quoted) {
     int tokens_cap = INIT_TOKENS;
     char **tokens = malloc(tokens_cap * sizeof(char *));
-    if (!tokens) {
+    char *flags = quoted ? malloc(tokens_cap) : NULL;
+    if (!tokens || (quoted && !flags)) {
         fprintf(stderr, "allocation error\n");
         exit(EXIT_FAILURE);
     }
     int token_index = 0;
-    char current_token[MAX_LINE];  // Temporary buffer to hold characters for the current token.
+    // Temporary buffer to hold characters for the current token (no token is longer than the input).
+    char *current_token = malloc(strlen(input) + 1);
+    if (!current_token) {
+        fprintf(stderr, "allocation error\n");
+        exit(EXIT_FAILURE);
+    }
     int ct_index = 0;              // Index in the current token buffer.
     int in_quotes = 0;             // Flag to track whether we are inside double quotes.
+    int first_quoted = 0;          // Whether the current token's first character was quoted.
     
     // Iterate through each character in the input string.
     for (int i = 0; input[i] != '\0'; i++) {
         char c = input[i];
-        if (c == '\"') {
+        size_t subst_len;
+        if ((c == '$' || c == '<' || c == '>') && input[i+1] == '(' &&
+            (subst_len = subst_length(input + i)) > 0) {
+            // Keep a command or process substitution intact (spaces and quotes included)
+            // so later expansion receives the whole "$(...)", "<(...)" or ">(...)" in one token.
+            memcpy(current_token + ct_index, input + i, subst_len);
+            ct_index += subst_len;
+            i += subst_len - 1;
+        } else if (c == '\"') {
             // Toggle the in_quotes flag when a double quote is encountered.
             in_quotes = !in_quotes;
         } else if ((c == ' ' || c == '\t') && !in_quotes) {
             // When encountering whitespace outside quotes, finish the current token.
             if (ct_index > 0) {  // Only add non-empty tokens.
                 current_token[ct_index] = '\0';
+                if (flags)
+                    flags[token_index] = first_quoted;
                 tokens[token_index++] = strdup(current_token);
                 ct_index = 0;
                 // Reallocate tokens array if the capacity is reached.
                 if (token_index >= tokens_cap) {
                     tokens_cap += INIT_TOKENS;
                     tokens = realloc(tokens, tokens_cap * sizeof(char *));
-                    if (!tokens) {
+                    if (flags)
+                        flags = realloc(flags, tokens_cap);
+                    if (!tokens || (quoted && !flags)) {
                         fprintf(stderr, "allocation error\n");
                         exit(EXIT_FAILURE);
                     }
@@ -196,15 +920,22 @@ char **parse_input(const char *input) {
             }
         } else {
             // Add the character to the current token.
+            if (ct_index == 0)
+                first_quoted = in_quotes;
             current_token[ct_index++] = c;
         }
     }
     // After the loop, add any remaining token to the tokens array.
     if (ct_index > 0) {
         current_token[ct_index] = '\0';
+        if (flags)
+            flags[token_index] = first_quoted;
         tokens[token_index++] = strdup(current_token);
     }
     tokens[token_index] = NULL;  // Terminate the tokens array with a NULL pointer.
+    free(current_token);
+    if (quoted)
+        *quoted = flags;
     return tokens;
 }
 
@@ -224,7 +955,26 @@ char *expand_variable(const char *token) {
     
     // Process each character in the input token.
     for (size_t i = 0; token[i] != '\0'; i++) {
-        if (token[i] == '$') {
+        size_t subst_len;
+        if (token[i] == '$' && token[i+1] == '(' && (subst_len = subst_length(token + i)) > 0) {
+            // Command substitution: run the enclosed command and splice in its output.
+            char *cmd = strndup(token + i + 2, subst_len - 3);
+            size_t olen;
+            char *output = command_substitution(cmd, &olen);
+            free(cmd);
+            while (len + olen + 1 > capacity) {
+                capacity *= 2;
+                result = realloc(result, capacity);
+                if (!result) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memcpy(result + len, output, olen + 1);
+            len += olen;
+            free(output);
+            i += subst_len - 1;  // Continue after the closing ')'.
+        } else if (token[i] == '$') {
             i++;  // Skip the '$' character.
             char varname[128];  // Buffer to hold the variable name.
             int j = 0;
@@ -248,7 +998,7 @@ char *expand_variable(const char *token) {
                 }
             }
             // Concatenate the environment variable value to the result string.
-            strcat(result, value);
+            memcpy(result + len, value, vlen + 1);
             len += vlen;
         } else {
             // For normal characters, ensure there is enough capacity and append the character.
@@ -268,6 +1018,443 @@ char *expand_variable(const char *token) {
     return result;
 }
 
+//-------------------------------------------------------------
+// subst_length: Given a string that starts with "$(" (or "<(" / ">("), returns the length of the
+// command substitution up to and including its matching ')'. Nested parentheses and
+// double-quoted text are skipped over. Returns 0 if the substitution is unterminated.
+size_t subst_length(const char *s) {
+    int depth = 0;
+    int in_quotes = 0;
+    for (size_t i = 1; s[i] != '\0'; i++) {
+        if (s[i] == '\"')
+            in_quotes = !in_quotes;
+        else if (in_quotes)
+            continue;
+        else if (s[i] == '(')
+            depth++;
+        else if (s[i] == ')' && --depth == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+//-------------------------------------------------------------
+// command_substitution: Runs the command text found inside "$(...)" and returns its
+// standard output as a heap string (length stored in *out_len), with trailing
+// newlines stripped in place. Output-only builtins run inside the shell process and
+// write into an in-memory stream, so no fork is needed for them; the rest are forked
+// like external commands so "$(cd /tmp)" cannot change the shell's own state.
+char *command_substitution(const char *cmd, size_t *out_len) {
+    char **tokens = parse_input(cmd);
+    char *output = NULL;
+    size_t len = 0;
+
+    if (tokens[0] == NULL) {
+        output = strdup("");
+    } else if (is_output_builtin(tokens[0])) {
+        // Capture the builtin's output in memory instead of on the terminal.
+        FILE *out = open_memstream(&output, &len);
+        if (!out) {
+            perror("open_memstream");
+            exit(EXIT_FAILURE);
+        }
+        execute_shell_builtin(tokens, out, NULL);
+        fclose(out);  // Finalizes output and len.
+    } else {
+        output = capture_command_output(tokens, &len);
+    }
+    free_tokens(tokens);
+
+    if (!output) {
+        fprintf(stderr, "allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    // Strip trailing newlines in place, as POSIX shells do for $(...).
+    while (len > 0 && output[len-1] == '\n')
+        output[--len] = '\0';
+    *out_len = len;
+    return output;
+}
+
+//-------------------------------------------------------------
+// capture_command_output: Forks a command with its stdout connected to a pipe and reads
+// everything it writes into a growable buffer. Builtins run in the forked child, which
+// expands their tokens itself. Reads go straight into the buffer's free space in chunks
+// of at least SUBST_CHUNK bytes, so large outputs cost few system calls and no extra
+// copies. The child is waited for before returning.
+char *capture_command_output(char **tokens, size_t *out_len) {
+    int builtin = is_shell_builtin(tokens[0]);
+    char **processed_tokens = builtin ? NULL : process_tokens(tokens);
+    size_t capacity = SUBST_CHUNK;
+    size_t len = 0;
+    char *buf = malloc(capacity + 1);
+    if (!buf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int fds[2];
+    if ((!builtin && processed_tokens[0] == NULL) || pipe2(fds, O_CLOEXEC) != 0) {
+        if (builtin || processed_tokens[0] != NULL)
+            perror("pipe");
+        goto done;
+    }
+    // A larger pipe lets the producer write big outputs with fewer context switches.
+    fcntl(fds[1], F_SETPIPE_SZ, SUBST_PIPE_SIZE);
+
+    // Block SIGCHLD so the child is in the job table before on_child_exit() can see it.
+    sigset_t old;
+    block_sigchld(&old);
+
+    int err_pipe[2] = { -1, -1 };
+    if (pipe2(err_pipe, O_CLOEXEC) != 0)
+        err_pipe[0] = err_pipe[1] = -1;  // Failed execs just go uncounted.
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        if (err_pipe[0] >= 0) {
+            close(err_pipe[0]);
+            close(err_pipe[1]);
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        goto done;
+    }
+    if (pid == 0) {  // Child process branch.
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        dup2(fds[1], STDOUT_FILENO);
+        if (builtin) {
+            // Close the error pipe before running: the parent waits for its EOF first.
+            if (err_pipe[0] >= 0) {
+                close(err_pipe[0]);
+                close(err_pipe[1]);
+            }
+            execute_shell_builtin(tokens, stdout, NULL);
+            fflush(stdout);
+            _exit(EXIT_SUCCESS);
+        }
+        execvp(processed_tokens[0], processed_tokens);
+        report_exec_failure(err_pipe[1]);
+        perror("execvp");
+        _exit(EXEC_FAILED);  // _exit: do not flush the parent's copied stdio buffers.
+    }
+    metrics.spawned++;
+    collect_exec_result(err_pipe);
+    close(fds[1]);
+    struct job *job = add_job(pid, "$(...)", 0);
+
+    // Read until EOF, growing the buffer geometrically.
+    for (;;) {
+        if (capacity - len < SUBST_CHUNK) {
+            capacity *= 2;
+            buf = realloc(buf, capacity + 1);
+            if (!buf) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t n = read(fds[0], buf + len, capacity - len);
+        if (n > 0)
+            len += n;
+        else if (n == 0)
+            break;
+        else if (errno != EINTR) {
+            perror("read");
+            break;
+        }
+    }
+    close(fds[0]);
+
+    wait_for_child(pid, job, &old, NULL);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+done:
+    buf[len] = '\0';
+    if (processed_tokens)
+        free_tokens(processed_tokens);
+    *out_len = len;
+    return buf;
+}
+
+//-------------------------------------------------------------
+// extract_here_input: Looks for here-documents ("<<DELIM", "<<-DELIM", "<< DELIM") and
+// here-strings ("<<< word", "<<<word") in the tokens, removes them from the array and
+// returns a sealed memfd holding the input (the last one wins if several are given).
+// A single-quoted delimiter ('EOF') disables variable expansion in the body. quoted holds
+// parse_input_quoted()'s flags: tokens that start inside double quotes ("<<<") are plain words.
+// Returns -1 if there is no here-input and -2 on a syntax or system error.
+int extract_here_input(char **tokens, char *quoted) {
+    int fd = -1;
+    for (int i = 0; tokens[i] != NULL; ) {
+        char *tok = tokens[i];
+        char *content = NULL;
+        size_t len = 0;
+        int used = 1;  // Number of tokens consumed by this redirection.
+
+        if (quoted[i]) {
+            i++;
+            continue;
+        } else if (strncmp(tok, "<<<", 3) == 0) {
+            // Here-string: the (expanded) word followed by a newline.
+            const char *word = tok + 3;
+            if (*word == '\0') {
+                word = tokens[i+1];
+                used = 2;
+            }
+            if (word == NULL) {
+                fprintf(stderr, "syntax error: missing word after <<<\n");
+                if (fd >= 0)
+                    close(fd);
+                return -2;
+            }
+            content = expand_variable(word);
+            len = strlen(content);
+            content = realloc(content, len + 2);
+            if (!content) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            content[len++] = '\n';
+            content[len] = '\0';
+        } else if (strncmp(tok, "<<", 2) == 0) {
+            // Here-document: read lines from the user until the delimiter.
+            const char *delim = tok + 2;
+            int strip_tabs = 0;
+            if (*delim == '-') {
+                strip_tabs = 1;
+                delim++;
+            }
+            if (*delim == '\0') {
+                delim = tokens[i+1];
+                used = 2;
+            }
+            if (delim == NULL) {
+                fprintf(stderr, "syntax error: missing delimiter after <<\n");
+                if (fd >= 0)
+                    close(fd);
+                return -2;
+            }
+            char *name = strdup(delim);
+            int expand = 1;
+            size_t nlen = strlen(name);
+            if (nlen >= 2 && name[0] == '\'' && name[nlen-1] == '\'') {
+                // Quoted delimiter: the body is taken literally.
+                memmove(name, name + 1, nlen - 2);
+                name[nlen-2] = '\0';
+                expand = 0;
+            }
+            content = read_heredoc_body(name, strip_tabs, expand, &len);
+            free(name);
+        } else {
+            i++;
+            continue;
+        }
+
+        if (fd >= 0)
+            close(fd);
+        fd = make_sealed_memfd(content, len);
+        free(content);
+        if (fd < 0)
+            return -2;
+
+        // Remove the consumed tokens, shifting the rest (and the NULL) down.
+        for (int k = 0; k < used; k++)
+            free(tokens[i+k]);
+        int j = i;
+        do {
+            tokens[j] = tokens[j+used];
+            if (tokens[j] != NULL)
+                quoted[j] = quoted[j+used];
+        } while (tokens[j++] != NULL);
+    }
+    return fd;
+}
+
+//-------------------------------------------------------------
+// read_heredoc_body: Reads input lines (prompting with "> ") until a line equal to
+// delim or end of input, and returns them concatenated in a growable buffer.
+// Lines have leading tabs removed when strip_tabs is set and $VAR/$(...) expanded when
+// expand is set. Lines of any length are accepted, so large inline payloads fit.
+char *read_heredoc_body(const char *delim, int strip_tabs, int expand, size_t *out_len) {
+    size_t capacity = MAX_LINE;
+    size_t len = 0;
+    char *body = malloc(capacity);
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    if (!body) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        printf("> ");
+        fflush(stdout);
+        if ((n = read_input_line(&line, &line_cap)) < 0)
+            break;  // End of input terminates the document.
+        char *text = line;
+        if (strip_tabs)
+            while (*text == '\t') {
+                text++;
+                n--;
+            }
+        // Compare against the delimiter without the trailing newline.
+        size_t text_len = (n > 0 && text[n-1] == '\n') ? (size_t)n - 1 : (size_t)n;
+        if (text_len == strlen(delim) && strncmp(text, delim, text_len) == 0)
+            break;
+
+        char *expanded = expand ? expand_variable(text) : NULL;
+        const char *chunk = expanded ? expanded : text;
+        size_t clen = expanded ? strlen(expanded) : (size_t)n;
+        while (len + clen + 1 > capacity) {
+            capacity *= 2;
+            body = realloc(body, capacity);
+            if (!body) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(body + len, chunk, clen);
+        len += clen;
+        free(expanded);
+    }
+    free(line);
+    body[len] = '\0';
+    *out_len = len;
+    return body;
+}
+
+//-------------------------------------------------------------
+// make_sealed_memfd: Stores data in an anonymous memory file (memfd_create), seals it
+// against any further modification and rewinds it, ready to become a child's stdin.
+// Nothing touches the filesystem, and the child may mmap the contents directly.
+// Returns the descriptor (close-on-exec) or -1 on failure.
+int make_sealed_memfd(const char *data, size_t len) {
+    int fd = memfd_create("myshell-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, data + off, len - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+        perror("fcntl(F_ADD_SEALS)");
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+//-------------------------------------------------------------
+// expand_process_substitutions: Replaces every "<(cmd)" / ">(cmd)" token with a
+// "/dev/fd/N" path. For each one a pipe is created and cmd is started right away as a
+// background job writing into (or reading from) it, so all producers run concurrently
+// with the main command instead of materializing temp files. The command's ends of
+// the pipes are recorded in attrs so execute_command() lets the child inherit them.
+void expand_process_substitutions(char **tokens, struct launch_attrs *attrs) {
+    for (int i = 0; tokens[i] != NULL; i++) {
+        char *tok = tokens[i];
+        if ((tok[0] != '<' && tok[0] != '>') || tok[1] != '(' || subst_length(tok) != strlen(tok))
+            continue;
+        if (attrs->n_pass_fds >= MAX_PASS_FDS) {
+            fprintf(stderr, "too many process substitutions\n");
+            break;
+        }
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            perror("pipe");
+            break;
+        }
+        // <(cmd): cmd writes into the pipe and the command reads /dev/fd/<read end>.
+        // >(cmd): the command writes /dev/fd/<write end> and cmd reads the pipe.
+        int reading = (tok[0] == '<');
+        int keep = reading ? fds[0] : fds[1];
+        int give = reading ? fds[1] : fds[0];
+        char *cmd = strndup(tok + 2, strlen(tok) - 3);
+        pid_t pid = spawn_substitution_process(cmd, reading ? STDOUT_FILENO : STDIN_FILENO, give);
+        free(cmd);
+        close(give);
+        if (pid < 0) {
+            close(keep);
+            continue;
+        }
+        attrs->pass_fds[attrs->n_pass_fds++] = keep;
+
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/fd/%d", keep);
+        free(tokens[i]);
+        tokens[i] = strdup(path);
+    }
+}
+
+//-------------------------------------------------------------
+// spawn_substitution_process: Forks cmd with pipe_end installed as target_fd (stdin or
+// stdout) and registers it as a background job, so it is reaped and logged by
+// on_child_exit() like any other child. Builtins run in the forked child.
+// Returns the child's PID, or -1 on failure.
+pid_t spawn_substitution_process(const char *cmd, int target_fd, int pipe_end) {
+    char **tokens = parse_input(cmd);
+    if (tokens[0] == NULL) {
+        free_tokens(tokens);
+        return -1;
+    }
+    sigset_t old;
+    block_sigchld(&old);
+    int err_pipe[2] = { -1, -1 };
+    if (pipe2(err_pipe, O_CLOEXEC) != 0)
+        err_pipe[0] = err_pipe[1] = -1;  // Failed execs just go uncounted.
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        if (err_pipe[0] >= 0) {
+            close(err_pipe[0]);
+            close(err_pipe[1]);
+        }
+    } else if (pid == 0) {  // Child process branch.
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        dup2(pipe_end, target_fd);
+        if (is_shell_builtin(tokens[0])) {
+            // No exec follows: close the error pipe now, or the parent, waiting for its EOF,
+            // would never read the substitution pipe this builtin may fill.
+            if (err_pipe[0] >= 0) {
+                close(err_pipe[0]);
+                close(err_pipe[1]);
+            }
+            execute_shell_builtin(tokens, stdout, NULL);
+            fflush(stdout);
+            _exit(EXIT_SUCCESS);
+        }
+        char **processed_tokens = process_tokens(tokens);
+        if (processed_tokens[0] != NULL) {
+            execvp(processed_tokens[0], processed_tokens);
+            report_exec_failure(err_pipe[1]);
+        }
+        perror("execvp");
+        _exit(EXEC_FAILED);
+    } else {
+        metrics.spawned++;
+        collect_exec_result(err_pipe);
+        char *text = malloc(strlen(cmd) + 4);
+        if (text) {
+            sprintf(text, "%c(%s)", target_fd == STDOUT_FILENO ? '<' : '>', cmd);
+            add_job(pid, text, JOB_HELPER);
+            free(text);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    free_tokens(tokens);
+    return pid;
+}
+
 //-------------------------------------------------------------
 // process_tokens: Takes an array of tokens, expands any environment variables,
 // and further splits tokens if the expansion results in embedded whitespace.
@@ -284,12 +1471,12 @@ char **process_tokens(char **tokens) {
     for (int i = 0; tokens[i] != NULL; i++) {
         // Expand any environment variables in the token.
         char *expanded = expand_variable(tokens[i]);
-        // Check if the expanded token contains any whitespace.
-        if (strchr(expanded, ' ') != NULL || strchr(expanded, '\t') != NULL) {
+        // Check if the expanded token contains any whitespace (newlines come from $(...)).
+        if (strpbrk(expanded, " \t\n") != NULL) {
             // Duplicate the expanded token to safely use strtok.
             char *temp = strdup(expanded);
             // Use strtok to split the token by spaces or tabs.
-            char *word = strtok(temp, " \t");
+            char *word = strtok(temp, " \t\n");
             while (word != NULL) {
                 // If necessary, reallocate the new tokens array.
                 if (count >= newSize) {
@@ -302,7 +1489,7 @@ char **process_tokens(char **tokens) {
                 }
                 // Duplicate each word and add it to the new tokens array.
                 new_tokens[count++] = strdup(word);
-                word = strtok(NULL, " \t");
+                word = strtok(NULL, " \t\n");
             }
             free(temp);    // Free the temporary duplicated string.
             free(expanded);  // Free the expanded token buffer.
@@ -324,9 +1511,32 @@ char **process_tokens(char **tokens) {
 }
 
 //-------------------------------------------------------------
-// execute_shell_builtin: Handles execution of built-in shell commands (cd, echo, export).
+// is_shell_builtin: Returns 1 if the command name is handled by execute_shell_builtin.
+int is_shell_builtin(const char *name) {
+    static const char *builtins[] = { "cd", "echo", "export", "parallel", "set", "jobs", "time", "pstat", "stats", "logq", "memstat", "limit", "affinity", "nice", "sched", "ulimit", "numa", "timeout", "kill", "loadctl", "supervise", NULL };
+    for (int i = 0; builtins[i] != NULL; i++)
+        if (strcmp(name, builtins[i]) == 0)
+            return 1;
+    return 0;
+}
+
+//-------------------------------------------------------------
+// is_output_builtin: Returns 1 for builtins that only report state and never change it,
+// so $(...) can run them inside the shell instead of forking.
+int is_output_builtin(const char *name) {
+    static const char *builtins[] = { "echo", "jobs", "stats", "logq", "memstat", "loadctl", NULL };
+    for (int i = 0; builtins[i] != NULL; i++)
+        if (strcmp(name, builtins[i]) == 0)
+            return 1;
+    return 0;
+}
+
+//-------------------------------------------------------------
+// execute_shell_builtin: Handles execution of built-in shell commands (cd, echo, export, parallel).
 // These commands are processed directly without forking a new process.
-void execute_shell_builtin(char **tokens) {
+// Regular output goes to 'out' (stdout, or an in-memory stream for $(...)); attrs holds
+// the command's here-input, if any (NULL when run from a substitution).
+void execute_shell_builtin(char **tokens, FILE *out, struct launch_attrs *attrs) {
     if (strcmp(tokens[0], "cd") == 0) {
         // Handle 'cd' command: if no argument or "~", change to HOME directory.
         if (tokens[1] == NULL || strcmp(tokens[1], "~") == 0) {
@@ -362,18 +1572,17 @@ void execute_shell_builtin(char **tokens) {
     else if (strcmp(tokens[0], "echo") == 0) {
         // Handle 'echo' command: Print out the arguments after expanding any variables.
         if (tokens[1] != NULL) {
-            char buffer[MAX_LINE] = "";
-            // Loop through all tokens after "echo".
+            // Loop through all tokens after "echo". Each expansion is written directly,
+            // since $(...) output can be far larger than any fixed buffer.
             for (int i = 1; tokens[i] != NULL; i++) {
                 char *expanded = expand_variable(tokens[i]);
-                strcat(buffer, expanded);
+                fputs(expanded, out);
                 // Add a space between tokens if it's not the last token.
                 if (tokens[i+1] != NULL)
-                    strcat(buffer, " ");
+                    fputc(' ', out);
                 free(expanded);
             }
-            // Print the final concatenated string.
-            printf("%s\n", buffer);
+            fputc('\n', out);
         }
     }
     else if (strcmp(tokens[0], "export") == 0) {
@@ -387,42 +1596,3877 @@ void execute_shell_builtin(char **tokens) {
                 // Split the string at '=' to separate variable name and value.
                 *eq = '\0';
                 char *var = tokens[1];
-                char *value = eq + 1;
+                // Expand $VAR and $(...) in the value before storing it.
+                char *value = expand_variable(eq + 1);
                 if (setenv(var, value, 1) != 0)
                     perror("export");
+                free(value);
             }
         } else {
             // If no argument is provided, print an error message.
             fprintf(stderr, "export: missing argument\n");
         }
     }
+    else if (strcmp(tokens[0], "parallel") == 0) {
+        builtin_parallel(tokens, out, attrs);
+    }
+    else if (strcmp(tokens[0], "set") == 0) {
+        builtin_set(tokens, out);
+    }
+    else if (strcmp(tokens[0], "jobs") == 0) {
+        builtin_jobs(out);
+    }
+    else if (strcmp(tokens[0], "time") == 0) {
+        builtin_time(tokens, out, attrs);
+    }
+    else if (strcmp(tokens[0], "pstat") == 0) {
+        builtin_pstat(tokens, out, attrs);
+    }
+    else if (strcmp(tokens[0], "stats") == 0) {
+        builtin_stats(out);
+    }
+    else if (strcmp(tokens[0], "logq") == 0) {
+        builtin_logq(tokens, out);
+    }
+    else if (strcmp(tokens[0], "memstat") == 0) {
+        builtin_memstat(out);
+    }
+    else if (strcmp(tokens[0], "limit") == 0) {
+        builtin_limit(tokens, out, attrs);
+    }
+    else if (strcmp(tokens[0], "supervise") == 0) {
+        builtin_supervise(tokens, out, attrs);
+    }
+    else if (strcmp(tokens[0], "loadctl") == 0) {
+        builtin_loadctl(out);
+    }
+    else if (strcmp(tokens[0], "kill") == 0) {
+        builtin_kill(tokens);
+    }
+    else if (strcmp(tokens[0], "timeout") == 0) {
+        builtin_timeout(tokens, out, attrs);
+    }
+    else if (strcmp(tokens[0], "ulimit") == 0) {
+        builtin_ulimit(tokens, out, attrs);
+    }
+    else if (strcmp(tokens[0], "affinity") == 0 || strcmp(tokens[0], "nice") == 0 || strcmp(tokens[0], "numa") == 0 ||
+             strcmp(tokens[0], "sched") == 0) {
+        builtin_launch_prefix(tokens, out, attrs);
+    }
 }
 
 //-------------------------------------------------------------
-// execute_command: Creates a child process using fork() and executes external commands via execvp().
-// For foreground commands, the parent waits until the child completes; for background commands, it does not wait.
-void execute_command(char **tokens, int background) {
-    pid_t pid = fork();
-    if (pid < 0) {
-        // If fork() fails, print an error message.
-        perror("fork");
+// builtin_time: time [-j|--json] command...
+// Runs the command in the foreground and reports its wall, user and system time, peak RSS,
+// minor/major page faults and voluntary/involuntary context switches, from the rusage that
+// wait4() returns when on_child_exit() reaps it (no /usr/bin/time process is involved).
+// Builtins are measured in-process with getrusage(RUSAGE_SELF). The report goes to stderr,
+// as a human-readable table or, with -j, a single JSON object.
+void builtin_time(char **tokens, FILE *out, struct launch_attrs *attrs) {
+    int json = 0;
+    int k = 1;
+    for (; tokens[k] != NULL && tokens[k][0] == '-'; k++) {
+        if (strcmp(tokens[k], "-j") == 0 || strcmp(tokens[k], "--json") == 0)
+            json = 1;
+        else
+            break;
+    }
+    char **cmd = tokens + k;
+    int n = 0;
+    while (cmd[n] != NULL)
+        n++;
+    if (n == 0) {
+        fprintf(stderr, "usage: time [-j|--json] command [args...]\n");
         return;
     }
-    if (pid == 0) {  // Child process branch.
-        // Execute the command using execvp; if it fails, print error and exit.
-        if (execvp(tokens[0], tokens) == -1) {
-            perror("execvp");
-        }
-        exit(EXIT_FAILURE);  // Exit if execution fails.
-    } else {  // Parent process branch.
-        if (!background) {
-            int status;
-            // Wait for the child process to complete if running in the foreground.
-            if (waitpid(pid, &status, 0) == -1)
-                perror("waitpid");
-            else if (WIFSIGNALED(status))
-                fprintf(stderr, "Child terminated abnormally by signal %d\n", WTERMSIG(status));
-        }
-        // If background, do not wait (child will be handled by the SIGCHLD handler).
+    if (strcmp(cmd[n-1], "&") == 0) {
+        fprintf(stderr, "time: cannot time a background command\n");
+        return;
+    }
+
+    struct child_result r;
+    memset(&r, 0, sizeof(r));
+    if (is_shell_builtin(cmd[0])) {
+        // Builtins never fork: measure the shell itself around the call.
+        struct rusage before, after;
+        double start = now_seconds();
+        getrusage(RUSAGE_SELF, &before);
+        execute_shell_builtin(cmd, out, attrs);
+        fflush(out);
+        getrusage(RUSAGE_SELF, &after);
+        r.wall = now_seconds() - start;
+        r.usage = after;
+        timersub(&after.ru_utime, &before.ru_utime, &r.usage.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &r.usage.ru_stime);
+        r.usage.ru_minflt -= before.ru_minflt;
+        r.usage.ru_majflt -= before.ru_majflt;
+        r.usage.ru_nvcsw -= before.ru_nvcsw;
+        r.usage.ru_nivcsw -= before.ru_nivcsw;
+    } else {
+        struct launch_attrs none;
+        init_launch_attrs(&none);
+        last_foreground.status = -1;
+        run_command(cmd, attrs ? attrs : &none);
+        r = last_foreground;
+        if (r.status == -1)
+            return;  // The command never ran (fork or expansion failed).
+    }
+
+    double user = r.usage.ru_utime.tv_sec + r.usage.ru_utime.tv_usec / 1e6;
+    double sys = r.usage.ru_stime.tv_sec + r.usage.ru_stime.tv_usec / 1e6;
+    char *command = join_tokens(cmd);
+    if (json) {
+        fprintf(stderr, "{\"command\":");
+        fput_json_string(command, stderr);
+        fprintf(stderr, ",\"status\":%d,\"signal\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+                "\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+                WIFEXITED(r.status) ? WEXITSTATUS(r.status) : -1,
+                WIFSIGNALED(r.status) ? WTERMSIG(r.status) : 0,
+                r.wall, user, sys, r.usage.ru_maxrss, r.usage.ru_minflt, r.usage.ru_majflt,
+                r.usage.ru_nvcsw, r.usage.ru_nivcsw);
+    } else {
+        fprintf(stderr, "\nreal   %10.3fs\n", r.wall);
+        fprintf(stderr, "user   %10.3fs\n", user);
+        fprintf(stderr, "sys    %10.3fs\n", sys);
+        fprintf(stderr, "maxrss %10ld KiB\n", r.usage.ru_maxrss);
+        fprintf(stderr, "faults %10ld minor %ld major\n", r.usage.ru_minflt, r.usage.ru_majflt);
+        fprintf(stderr, "ctxsw  %10ld voluntary %ld involuntary\n", r.usage.ru_nvcsw, r.usage.ru_nivcsw);
+        if (WIFSIGNALED(r.status))
+            fprintf(stderr, "status     signal %d\n", WTERMSIG(r.status));
+        else if (WIFEXITED(r.status) && WEXITSTATUS(r.status) != 0)
+            fprintf(stderr, "status     exit %d\n", WEXITSTATUS(r.status));
+    }
+    free(command);
+}
+
+//-------------------------------------------------------------
+// fput_json_string: Writes s to out as a JSON string literal (quotes included) for the -j
+// reports of time and pstat. Quotes and backslashes are escaped, control characters as \uXXXX.
+void fput_json_string(const char *s, FILE *out) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)s; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+//-------------------------------------------------------------
+// builtin_pstat: pstat [-j|--json] command...
+// Runs an external command in the foreground with hardware counters (cycles, instructions,
+// cache references/misses, branches/branch misses) attached to it between fork and exec,
+// and prints the counts with IPC and miss rates once it is reaped. The counters inherit
+// into the command's own children. When the PMU is unavailable (e.g. in a VM, or blocked
+// by perf_event_paranoid) software counters are used instead.
+void builtin_pstat(char **tokens, FILE *out, struct launch_attrs *attrs) {
+    (void)out;
+    int json = 0;
+    int k = 1;
+    for (; tokens[k] != NULL && tokens[k][0] == '-'; k++) {
+        if (strcmp(tokens[k], "-j") == 0 || strcmp(tokens[k], "--json") == 0)
+            json = 1;
+        else
+            break;
+    }
+    char **cmd = tokens + k;
+    int n = 0;
+    while (cmd[n] != NULL)
+        n++;
+    if (n == 0 || is_shell_builtin(cmd[0]) || strcmp(cmd[n-1], "&") == 0) {
+        fprintf(stderr, "usage: pstat [-j|--json] external-command [args...]   (foreground only)\n");
+        return;
+    }
+
+    struct perf_counters pc;
+    memset(&pc, 0, sizeof(pc));
+    struct launch_attrs none;
+    init_launch_attrs(&none);
+    if (!attrs)
+        attrs = &none;
+    attrs->on_launch = attach_perf_counters;
+    attrs->on_launch_arg = &pc;
+    last_foreground.status = -1;
+    run_command(cmd, attrs);
+    attrs->on_launch = NULL;
+    if (pc.n == 0)
+        return;  // The command never started.
+
+    // Counters stay readable after the task exits; scale for multiplexing.
+    for (int i = 0; i < pc.n; i++) {
+        uint64_t buf[3];  // value, time enabled, time running
+        pc.value[i] = 0;
+        if (pc.fd[i] < 0)
+            continue;
+        if (read(pc.fd[i], buf, sizeof(buf)) == sizeof(buf)) {
+            pc.value[i] = buf[0];
+            if (buf[2] > 0 && buf[2] < buf[1])
+                pc.value[i] = (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+        }
+        close(pc.fd[i]);
+    }
+
+    char *command = join_tokens(cmd);
+    if (json) {
+        fprintf(stderr, "{\"command\":");
+        fput_json_string(command, stderr);
+        fprintf(stderr, ",\"source\":\"%s\",\"real\":%.6f", pc.hardware ? "hardware" : "software",
+                last_foreground.wall);
+        for (int i = 0; i < pc.n; i++)
+            if (pc.fd[i] >= 0)
+                fprintf(stderr, ",\"%s\":%llu", pc.name[i], (unsigned long long)pc.value[i]);
+        if (pc.hardware && pc.value[0] > 0)
+            fprintf(stderr, ",\"ipc\":%.3f", (double)pc.value[1] / pc.value[0]);
+        fprintf(stderr, "}\n");
+    } else {
+        fprintf(stderr, "\n %s counters for '%s' (%.3fs):\n",
+                pc.hardware ? "Hardware" : "Software (no PMU access)", command, last_foreground.wall);
+        for (int i = 0; i < pc.n; i++) {
+            if (pc.fd[i] < 0) {
+                fprintf(stderr, " %18s  %-18s\n", "<not supported>", pc.name[i]);
+                continue;
+            }
+            fprintf(stderr, " %18llu  %-18s", (unsigned long long)pc.value[i], pc.name[i]);
+            // Rates pair each event with the one before it: instructions/cycles, misses/accesses.
+            if (pc.hardware && i == 1 && pc.fd[0] >= 0 && pc.value[0] > 0)
+                fprintf(stderr, "# %.2f insn per cycle", (double)pc.value[1] / pc.value[0]);
+            else if (pc.hardware && (i == 3 || i == 5) && pc.fd[i-1] >= 0 && pc.value[i-1] > 0)
+                fprintf(stderr, "# %.2f%% of %s", 100.0 * pc.value[i] / pc.value[i-1], pc.name[i-1]);
+            fputc('\n', stderr);
+        }
+    }
+    free(command);
+}
+
+//-------------------------------------------------------------
+// attach_perf_counters: on_launch hook for pstat. Opens the counters on the freshly forked
+// child (which is still waiting before exec) with enable_on_exec and inherit, so they
+// count the command's program and its descendants but not the shell's fork path.
+// If the cycles counter cannot be opened, software counters are used instead.
+void attach_perf_counters(pid_t pid, void *arg) {
+    static const struct { const char *name; uint64_t config; } hw[] = {
+        { "cycles", PERF_COUNT_HW_CPU_CYCLES },
+        { "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+        { "cache-references", PERF_COUNT_HW_CACHE_REFERENCES },
+        { "cache-misses", PERF_COUNT_HW_CACHE_MISSES },
+        { "branches", PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+        { "branch-misses", PERF_COUNT_HW_BRANCH_MISSES },
+    };
+    static const struct { const char *name; uint64_t config; } sw[] = {
+        { "task-clock-ns", PERF_COUNT_SW_TASK_CLOCK },
+        { "context-switches", PERF_COUNT_SW_CONTEXT_SWITCHES },
+        { "cpu-migrations", PERF_COUNT_SW_CPU_MIGRATIONS },
+        { "page-faults", PERF_COUNT_SW_PAGE_FAULTS },
+    };
+    struct perf_counters *pc = arg;
+    pc->n = 0;
+    pc->hardware = 1;
+    for (size_t i = 0; i < sizeof(hw) / sizeof(hw[0]); i++) {
+        pc->name[pc->n] = hw[i].name;
+        pc->fd[pc->n] = open_perf_counter(PERF_TYPE_HARDWARE, hw[i].config, pid);
+        pc->n++;
+        if (i == 0 && pc->fd[0] < 0)
+            break;  // No PMU: fall back to software events.
+    }
+    if (pc->fd[0] >= 0)
+        return;
+    pc->n = 0;
+    pc->hardware = 0;
+    for (size_t i = 0; i < sizeof(sw) / sizeof(sw[0]); i++) {
+        pc->name[pc->n] = sw[i].name;
+        pc->fd[pc->n] = open_perf_counter(PERF_TYPE_SOFTWARE, sw[i].config, pid);
+        pc->n++;
+    }
+    if (pc->fd[0] < 0)
+        perror("pstat: perf_event_open");
+}
+
+//-------------------------------------------------------------
+// open_perf_counter: Opens one user-space counter on pid that starts disabled, is enabled
+// by the child's exec and follows its children. Returns the fd or -1.
+int open_perf_counter(uint32_t type, uint64_t config, pid_t pid) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;  // Allowed at perf_event_paranoid=2.
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+//-------------------------------------------------------------
+// builtin_set: "set name=value" changes a shell setting; "set" alone lists them.
+// Values are expanded first, so "set maxjobs=$(nproc)" works.
+//   maxjobs    Maximum '&' jobs running at once; 0 means unlimited, "auto" lets the load
+//              controller adjust it (see loadctl).
+//   loadtarget Runnable tasks per online CPU that maxjobs=auto aims for (default 1.0).
+//   sched      "cpu" pins '&' jobs to per-CPU run queues; "off" (default) leaves placement to the kernel.
+//   coreslots  Jobs allowed to run at once on each CPU in sched=cpu mode (default 1).
+//   memstat    "on" counts heap use per command line and reports it (with RSS) on stderr.
+//   numa       "rr" or "least" places '&' jobs on NUMA nodes round-robin or on the node with
+//              the fewest running jobs; "off" (default) leaves placement to the kernel.
+//   psimem     Holds new '&' jobs while tasks stall on memory more than N% of the time (PSI);
+//   psicpu     likewise for CPU. 0 (default) turns the check off.
+//   cgkill     "on" kills whatever a "limit" job left in its cgroup when the job ends (cgroup.kill).
+void builtin_set(char **tokens, FILE *out) {
+    if (tokens[1] == NULL) {
+        if (loadctl.enabled)
+            fprintf(out, "maxjobs=auto (now %d)\n", job_queue.max_jobs);
+        else
+            fprintf(out, "maxjobs=%d\n", job_queue.max_jobs);
+        fprintf(out, "loadtarget=%.2f\n", loadctl.target);
+        fprintf(out, "sched=%s\n", cpu_sched.enabled ? "cpu" : "off");
+        fprintf(out, "coreslots=%d\n", cpu_sched.slots);
+        fprintf(out, "memstat=%s\n", memstat.enabled ? "on" : "off");
+        fprintf(out, "numa=%s\n", numa.policy == NUMA_ROUND_ROBIN ? "rr" : numa.policy == NUMA_LEAST_LOADED ? "least" : "off");
+        fprintf(out, "psimem=%d\n", psi.monitors[0].percent);
+        fprintf(out, "psicpu=%d\n", psi.monitors[1].percent);
+        fprintf(out, "cgkill=%s\n", job_control.cgroup_kill ? "on" : "off");
+        return;
+    }
+    for (int i = 1; tokens[i] != NULL; i++) {
+        char *eq = strchr(tokens[i], '=');
+        if (eq == NULL) {
+            fprintf(stderr, "set: expected name=value: %s\n", tokens[i]);
+            continue;
+        }
+        char *value = expand_variable(eq + 1);
+        char *end;
+        long n = strtol(value, &end, 10);
+        if (strncmp(tokens[i], "maxjobs=", 8) == 0) {
+            if (strcmp(value, "auto") == 0)
+                set_adaptive_jobs(1);
+            else if (*value == '\0' || *end != '\0' || n < 0)
+                fprintf(stderr, "set: maxjobs must be a non-negative number or auto\n");
+            else {
+                set_adaptive_jobs(0);
+                job_queue.max_jobs = n;
+                dispatch_job_queue();  // A higher limit may admit queued commands now.
+            }
+        } else if (strncmp(tokens[i], "loadtarget=", 11) == 0) {
+            double target = strtod(value, &end);
+            if (*value == '\0' || *end != '\0' || target <= 0)
+                fprintf(stderr, "set: loadtarget must be a positive number\n");
+            else
+                loadctl.target = target;
+        } else if (strncmp(tokens[i], "sched=", 6) == 0) {
+            if (strcmp(value, "cpu") == 0 || strcmp(value, "off") == 0)
+                set_cpu_sched(strcmp(value, "cpu") == 0);
+            else
+                fprintf(stderr, "set: sched must be cpu or off\n");
+        } else if (strncmp(tokens[i], "coreslots=", 10) == 0) {
+            if (*value == '\0' || *end != '\0' || n < 1)
+                fprintf(stderr, "set: coreslots must be a positive number\n");
+            else {
+                cpu_sched.slots = n;
+                dispatch_job_queue();
+            }
+        } else if (strncmp(tokens[i], "memstat=", 8) == 0) {
+            if (strcmp(value, "on") == 0 || strcmp(value, "off") == 0) {
+                int enable = strcmp(value, "on") == 0;
+                if (enable && !memstat.enabled) {
+                    memset(&memstat, 0, sizeof(memstat));  // Accounting starts with the next line.
+                    clear_tracked_blocks();
+                }
+                memstat.enabled = enable;
+            } else {
+                fprintf(stderr, "set: memstat must be on or off\n");
+            }
+        } else if (strncmp(tokens[i], "numa=", 5) == 0) {
+            if (strcmp(value, "off") == 0)
+                numa.policy = NUMA_OFF;
+            else if (strcmp(value, "rr") != 0 && strcmp(value, "least") != 0)
+                fprintf(stderr, "set: numa must be rr, least or off\n");
+            else if (load_numa_topology() < 1)
+                fprintf(stderr, "set: no NUMA topology in /sys/devices/system/node\n");
+            else
+                numa.policy = strcmp(value, "rr") == 0 ? NUMA_ROUND_ROBIN : NUMA_LEAST_LOADED;
+        } else if (strncmp(tokens[i], "psimem=", 7) == 0 || strncmp(tokens[i], "psicpu=", 7) == 0) {
+            if (*value == '\0' || *end != '\0' || n < 0 || n > 100)
+                fprintf(stderr, "set: %.6s must be a percentage from 0 to 100\n", tokens[i]);
+            else
+                set_psi_threshold(&psi.monitors[tokens[i][3] == 'c' ? 1 : 0], n);
+        } else if (strncmp(tokens[i], "cgkill=", 7) == 0) {
+            if (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)
+                job_control.cgroup_kill = strcmp(value, "on") == 0;
+            else
+                fprintf(stderr, "set: cgkill must be on or off\n");
+        } else {
+            fprintf(stderr, "set: unknown setting: %.*s\n", (int)(eq - tokens[i]), tokens[i]);
+        }
+        free(value);
+    }
+}
+
+//-------------------------------------------------------------
+// builtin_jobs: Lists running and finished-but-unreleased jobs, then the admission queue
+// (position, time waited so far, command) and its statistics.
+void builtin_jobs(FILE *out) {
+    static const char *kinds[] = { "foreground", "background", "helper" };
+    sigset_t old;
+    block_sigchld(&old);
+    double now = now_seconds();
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *job = &job_table[i];
+        if (job->state == JOB_FREE)
+            continue;
+        fprintf(out, "[%d] %-7s %-10s pid %-7d %7.1fs  %s", job->id,
+                job->state != JOB_RUNNING ? "Done" : job->stopped ? "Stopped" : "Running", kinds[job->kind],
+                (int)job->pid, now - job->start, job->command);
+        if (job->supervisor)
+            fprintf(out, "  (supervised s%d, restarts=%d)", job->supervisor, job->restarts);
+        fprintf(out, "\n");
+    }
+    int pos = 1;
+    for (struct queued_command *q = job_queue.pending.head; q != NULL; q = q->next, pos++) {
+        char *command = join_tokens(q->argv);
+        fprintf(out, "[q%d] Queued  waiting %.1fs  %s\n", pos, now - q->enqueued, command);
+        free(command);
+    }
+    fprintf(out, "maxjobs=%d running=%d queued=%d dispatched=%ld avg_wait=%.3fs max_wait=%.3fs\n",
+            job_queue.max_jobs, count_background_jobs(), job_queue.pending.depth, job_queue.dispatched,
+            job_queue.dispatched ? job_queue.total_wait / job_queue.dispatched : 0.0,
+            job_queue.max_wait);
+    if (cpu_sched.enabled)
+        print_cpu_sched(out);
+    for (int i = 0; i < MAX_SUPERVISORS; i++) {
+        struct supervisor *sup = &supervision.entries[i];
+        if (sup->active && sup->pid == 0) {
+            char *command = join_tokens(sup->argv);
+            fprintf(out, "[s%d] Restarting in %.1fs (restart %d)  %s\n", i + 1,
+                    sup->next_start - now, sup->restarts, command);
+            free(command);
+        }
+    }
+    if (numa.policy != NUMA_OFF)
+        print_numa_nodes(out);
+    for (int m = 0; m < 2; m++)
+        if (psi.monitors[m].fd >= 0)
+            fprintf(out, "psi %s: threshold=%d%% %s (paused %ld times)\n", psi.monitors[m].name,
+                    psi.monitors[m].percent, psi.monitors[m].pressured ? "pressured, holding '&' jobs" : "ok",
+                    psi.holds);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//-------------------------------------------------------------
+// builtin_parallel: parallel [-j N] [-k] [--tag] cmd [args with {}] [::: input...]
+// Runs cmd once per input, replacing {} with the input (or appending it if there is no {}).
+// Inputs come from the words after ":::", else from the here-document/here-string, else
+// from the shell's stdin until end of file. Exactly N children (default: online CPUs) are
+// kept in flight; each one is launched through launch_command() and reaped by
+// on_child_exit(), and a slot is refilled as soon as a child finishes.
+// Each job's stdout is collected in a memfd and printed as a group when the job ends
+// (in input order with -k, each line prefixed by the input with --tag).
+// A timing summary is printed to stderr at the end.
+void builtin_parallel(char **tokens, FILE *out, const struct launch_attrs *attrs) {
+    // One unit of work: an input value and the state of the child running it.
+    struct par_task {
+        char *arg;
+        pid_t pid;
+        int out_fd;
+        int done;
+        int status;
+        double start, end;
+    };
+    char **words = process_tokens(tokens + 1);
+    long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0, tag = 0;
+    int w = 0;
+
+    // Options come first; the command runs up to ":::" (or the end).
+    for (; words[w] != NULL && words[w][0] == '-'; w++) {
+        if (strcmp(words[w], "-k") == 0)
+            keep_order = 1;
+        else if (strcmp(words[w], "--tag") == 0)
+            tag = 1;
+        else if (strncmp(words[w], "-j", 2) == 0) {
+            const char *n = words[w][2] ? words[w] + 2 : words[++w];
+            if (n == NULL || (max_running = atol(n)) <= 0) {
+                fprintf(stderr, "parallel: -j needs a positive number\n");
+                free_tokens(words);
+                return;
+            }
+        } else
+            break;
+    }
+    if (max_running < 1)
+        max_running = 1;
+    if (max_running > MAX_JOBS / 2)
+        max_running = MAX_JOBS / 2;  // Leave room in the job table for other children.
+    int cmd_start = w;
+    while (words[w] != NULL && strcmp(words[w], ":::") != 0)
+        w++;
+    int cmd_len = w - cmd_start;
+    if (cmd_len == 0) {
+        fprintf(stderr, "usage: parallel [-j N] [-k] [--tag] command [{}] [::: args...]\n");
+        free_tokens(words);
+        return;
+    }
+
+    // Gather the inputs.
+    int n_tasks = 0, cap_tasks = INIT_TOKENS;
+    struct par_task *tasks = malloc(cap_tasks * sizeof(*tasks));
+    if (!tasks) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    char **inputs = NULL;
+    char *line = NULL;
+    size_t line_cap = 0;
+    FILE *in = NULL;
+    if (words[w] != NULL) {
+        inputs = words + w + 1;
+    } else if (attrs && attrs->stdin_fd >= 0) {
+        in = fdopen(dup(attrs->stdin_fd), "r");
+    }
+    for (int i = 0; ; i++) {
+        char *arg;
+        if (inputs) {
+            if (inputs[i] == NULL)
+                break;
+            arg = strdup(inputs[i]);
+        } else {
+            ssize_t n = in ? getline(&line, &line_cap, in) : read_input_line(&line, &line_cap);
+            if (n < 0)
+                break;
+            if (n > 0 && line[n-1] == '\n')
+                line[--n] = '\0';
+            arg = strdup(line);
+        }
+        if (n_tasks == cap_tasks) {
+            cap_tasks *= 2;
+            tasks = realloc(tasks, cap_tasks * sizeof(*tasks));
+            if (!tasks) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        tasks[n_tasks].arg = arg;
+        tasks[n_tasks].pid = -1;
+        tasks[n_tasks].out_fd = -1;
+        tasks[n_tasks].done = 0;
+        tasks[n_tasks].status = 0;
+        n_tasks++;
+    }
+    free(line);
+    if (in != NULL)
+        fclose(in);
+
+    // Argument vector template: the command words plus room for an appended input.
+    int has_placeholder = 0;
+    for (int k = 0; k < cmd_len; k++)
+        if (strstr(words[cmd_start + k], "{}") != NULL)
+            has_placeholder = 1;
+    char **argv = malloc((cmd_len + 2) * sizeof(char *));
+    int *running = malloc(max_running * sizeof(int));  // Task index per busy slot.
+    if (!argv || !running) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    sigset_t old;
+    block_sigchld(&old);
+    double t0 = now_seconds();
+    int next = 0, n_running = 0, finished = 0, printed = 0, failed = 0;
+    pid_t group = 0;  // Process group of the running children
+    double busy = 0, longest = 0;
+    while (finished < n_tasks) {
+        // Fill every free slot.
+        while (n_running < max_running && next < n_tasks) {
+            struct par_task *t = &tasks[next];
+            for (int k = 0; k < cmd_len; k++) {
+                const char *word = words[cmd_start + k];
+                const char *ph = strstr(word, "{}");
+                if (ph == NULL) {
+                    argv[k] = strdup(word);
+                    continue;
+                }
+                // Replace the first {} in the word with the input.
+                argv[k] = malloc(strlen(word) + strlen(t->arg) - 1);
+                if (!argv[k]) {
+                    perror("malloc");
+                    exit(EXIT_FAILURE);
+                }
+                sprintf(argv[k], "%.*s%s%s", (int)(ph - word), word, t->arg, ph + 2);
+            }
+            argv[cmd_len] = has_placeholder ? NULL : strdup(t->arg);
+            argv[cmd_len + 1] = NULL;
+
+            // All children share one process group, which holds the terminal while any of
+            // them runs, so ^C reaches every child and never the shell. The group lives as
+            // long as an unreaped member; after that the next child starts a new one.
+            int group_alive = 0;
+            for (int r = 0; r < n_running && !group_alive; r++) {
+                struct job *job = find_job(tasks[running[r]].pid);
+                group_alive = job && job->state == JOB_RUNNING && job->pgid == group;
+            }
+            struct launch_attrs child_attrs;
+            init_launch_attrs(&child_attrs);
+            child_attrs.pgid = group_alive ? group : 0;
+            t->out_fd = memfd_create("myshell-parallel", MFD_CLOEXEC);
+            child_attrs.stdout_fd = t->out_fd;
+            t->start = now_seconds();
+            t->pid = launch_command(argv, JOB_FOREGROUND, &child_attrs);
+            if (t->pid > 0 && !group_alive)
+                group = t->pid;
+            for (int k = 0; argv[k] != NULL; k++)
+                free(argv[k]);
+            if (t->pid < 0) {
+                t->done = 1;
+                t->status = -1;
+                t->end = t->start;
+                finished++;
+                failed++;
+            } else {
+                running[n_running++] = next;
+            }
+            next++;
+        }
+
+        // Collect finished children; sleep until SIGCHLD if none are done yet.
+        int progressed = 0;
+        for (int r = 0; r < n_running; ) {
+            struct par_task *t = &tasks[running[r]];
+            struct job *job = find_job(t->pid);
+            if (job && job->state == JOB_RUNNING) {
+                r++;
+                continue;
+            }
+            t->status = wait_for_child(t->pid, job, &old, NULL);
+            t->end = now_seconds();
+            t->done = 1;
+            busy += t->end - t->start;
+            if (t->end - t->start > longest)
+                longest = t->end - t->start;
+            if (t->status == -1 || !WIFEXITED(t->status) || WEXITSTATUS(t->status) != 0)
+                failed++;
+            finished++;
+            progressed = 1;
+            running[r] = running[--n_running];
+        }
+
+        // Print whatever output may be released now.
+        for (int i = keep_order ? printed : 0; i < n_tasks; i++) {
+            struct par_task *t = &tasks[i];
+            if (!t->done) {
+                if (keep_order)
+                    break;
+                continue;
+            }
+            if (t->out_fd >= 0) {
+                char buf[SUBST_CHUNK];
+                ssize_t n;
+                int at_line_start = 1;
+                lseek(t->out_fd, 0, SEEK_SET);
+                while ((n = read(t->out_fd, buf, sizeof(buf))) > 0) {
+                    if (!tag) {
+                        fwrite(buf, 1, n, out);
+                        continue;
+                    }
+                    for (ssize_t b = 0; b < n; b++) {
+                        if (at_line_start)
+                            fprintf(out, "%s\t", t->arg);
+                        fputc(buf[b], out);
+                        at_line_start = (buf[b] == '\n');
+                    }
+                }
+                close(t->out_fd);
+                t->out_fd = -1;
+            }
+            if (keep_order)
+                printed = i + 1;
+        }
+        fflush(out);
+
+        if (!progressed && n_running > 0)
+            wait_for_sigchld(&old);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    double wall = now_seconds() - t0;
+
+    fprintf(stderr, "parallel: %d jobs, %d failed, -j %ld, %.3fs wall, %.3fs job time, longest %.3fs\n",
+            n_tasks, failed, max_running, wall, busy, longest);
+    for (int i = 0; i < n_tasks; i++)
+        free(tasks[i].arg);
+    free(tasks);
+    free(running);
+    free(argv);
+    free_tokens(words);
+}
+
+//-------------------------------------------------------------
+// init_launch_attrs: Resets launch attributes so the child inherits everything from the shell.
+void init_launch_attrs(struct launch_attrs *attrs) {
+    attrs->stdin_fd = -1;
+    attrs->stdout_fd = -1;
+    attrs->cpu = -1;
+    attrs->on_launch = NULL;
+    attrs->on_launch_arg = NULL;
+    attrs->n_pass_fds = 0;
+    attrs->cgroup_fd = -1;
+    attrs->nice = 0;
+    attrs->policy = -1;
+    attrs->priority = 0;
+    attrs->has_affinity = 0;
+    attrs->n_rlimits = 0;
+    attrs->numa_node = -1;
+    attrs->timeout = 0;
+    attrs->kill_after = 0;
+    attrs->pgid = 0;
+}
+
+//-------------------------------------------------------------
+// release_launch_attrs: Closes the shell's copies of the descriptors held in attrs
+// once the command has been started (or abandoned).
+void release_launch_attrs(struct launch_attrs *attrs) {
+    if (attrs->stdin_fd >= 0)
+        close(attrs->stdin_fd);
+    attrs->stdin_fd = -1;
+    if (attrs->stdout_fd >= 0)
+        close(attrs->stdout_fd);
+    attrs->stdout_fd = -1;
+    for (int i = 0; i < attrs->n_pass_fds; i++)
+        close(attrs->pass_fds[i]);
+    attrs->n_pass_fds = 0;
+    if (attrs->cgroup_fd >= 0)
+        close(attrs->cgroup_fd);  // The job holds its own descriptor.
+    attrs->cgroup_fd = -1;
+}
+
+//-------------------------------------------------------------
+// execute_command: Creates a child process using fork() and executes external commands via execvp().
+// For foreground commands, the parent waits until the child completes; for background commands, it does not wait.
+// attrs (may be NULL) describes redirections and other settings applied in the child before exec.
+// Background commands over the maxjobs limit are queued and take over attrs' descriptors.
+void execute_command(char **tokens, int background, struct launch_attrs *attrs) {
+    // Block SIGCHLD until the child is recorded, so on_child_exit() cannot miss it.
+    sigset_t old;
+    block_sigchld(&old);
+    if (background && cpu_sched.enabled) {
+        // CPU-affine mode: pin to a CPU now or wait in that CPU's run queue.
+        schedule_on_core(tokens, attrs);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return;
+    }
+    if (background && (job_queue.pending.head != NULL || !background_slot_free())) {
+        // Over the concurrency cap: hold the command until a running job finishes.
+        enqueue_command(tokens, attrs);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return;
+    }
+    pid_t pid = launch_command(tokens, background ? JOB_BACKGROUND : JOB_FOREGROUND, attrs);
+    if (pid > 0 && !background) {
+        // Wait for the child process to complete if running in the foreground.
+        int status = wait_for_child(pid, find_job(pid), &old, &last_foreground);
+        if (status != -1 && WIFSIGNALED(status))
+            fprintf(stderr, "Child terminated abnormally by signal %d\n", WTERMSIG(status));
+    }
+    // If background, do not wait (child will be handled by the SIGCHLD handler).
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//-------------------------------------------------------------
+// launch_command: Forks a child that applies attrs and execs tokens, and records it in the
+// job table as the given enum job_kind. Must be called with SIGCHLD blocked; the caller
+// decides whether to wait. Returns the child's PID, or -1 if fork() failed.
+pid_t launch_command(char **tokens, int kind, const struct launch_attrs *attrs) {
+    sigset_t old;
+    sigprocmask(SIG_SETMASK, NULL, &old);
+    pid_t pgid = attrs ? attrs->pgid : 0;
+    // Place '&' jobs on a NUMA node unless the command already chose its CPUs or node.
+    struct launch_attrs placed;
+    if (kind == JOB_BACKGROUND && numa.policy != NUMA_OFF &&
+        (attrs == NULL || (attrs->numa_node < 0 && !attrs->has_affinity))) {
+        if (attrs)
+            placed = *attrs;
+        else
+            init_launch_attrs(&placed);
+        int index = -1;
+        if (placed.cpu >= 0) {
+            // Pinned by sched=cpu: keep the CPU and prefer the memory of its node.
+            for (int n = 0; n < numa.n_nodes; n++)
+                if (CPU_ISSET(placed.cpu, &numa.nodes[n].cpus))
+                    placed.numa_node = numa.nodes[n].id;
+        } else {
+            index = pick_numa_node();
+        }
+        if (index >= 0)
+            place_on_numa_node(&placed, index);
+        attrs = &placed;
+    }
+    // With an on_launch hook the child waits for EOF on this pipe before it execs.
+    int gate[2] = { -1, -1 };
+    if (attrs && attrs->on_launch && pipe2(gate, O_CLOEXEC) != 0) {
+        perror("pipe");
+        return -1;
+    }
+    // The child reports a failed execvp() on this pipe; EOF means the exec happened.
+    int err_pipe[2] = { -1, -1 };
+    if (pipe2(err_pipe, O_CLOEXEC) != 0)
+        err_pipe[0] = err_pipe[1] = -1;  // Failed execs just go uncounted.
+    double start = now_seconds();  // Taken before fork(): the child may finish before add_job().
+    pid_t pid = attrs && attrs->cgroup_fd >= 0 ? fork_into_cgroup(attrs->cgroup_fd) : fork();
+    if (pid > 0) {
+        metrics.spawned++;
+        double forked = now_seconds();
+        hist_record(&stats.spawn, forked - start);
+        trace_record("fork", start, forked, pid);
+    }
+    if (pid < 0) {
+        // If fork() fails, print an error message.
+        perror("fork");
+        if (gate[0] >= 0) {
+            close(gate[0]);
+            close(gate[1]);
+        }
+        if (err_pipe[0] >= 0) {
+            close(err_pipe[0]);
+            close(err_pipe[1]);
+        }
+        return -1;
+    }
+    if (pid == 0) {  // Child process branch.
+        sigdelset(&old, SIGCHLD);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        // With job control, lead a new process group or join the one given (the parent does the
+        // same, whichever runs first), and as a foreground leader take the terminal so ^C and ^Z
+        // reach this job and not the shell. Members of a joined group find it holding the
+        // terminal. Without it the child stays in the shell's group and dies with it on ^C.
+        if (job_control.terminal) {
+            setpgid(0, pgid);
+            if (kind == JOB_FOREGROUND && pgid == 0)
+                tcsetpgrp(STDIN_FILENO, getpid());
+            signal(SIGTTOU, SIG_DFL);
+        }
+        if (gate[0] >= 0) {
+            char c;
+            close(gate[1]);
+            while (read(gate[0], &c, 1) < 0 && errno == EINTR)
+                ;
+            close(gate[0]);
+        }
+        // Install the here-document/here-string (if any) as standard input.
+        if (attrs && attrs->stdin_fd >= 0 && dup2(attrs->stdin_fd, STDIN_FILENO) < 0) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+        if (attrs && attrs->stdout_fd >= 0 && dup2(attrs->stdout_fd, STDOUT_FILENO) < 0) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+        // Scheduling attributes from the affinity/nice/sched prefixes. Failing to apply one
+        // the user asked for is fatal, as with taskset/nice/chrt.
+        if (attrs && attrs->has_affinity && sched_setaffinity(0, sizeof(attrs->affinity), &attrs->affinity) != 0) {
+            perror("affinity");
+            _exit(EXIT_FAILURE);
+        }
+        if (attrs && attrs->nice != 0) {
+            errno = 0;
+            if (nice(attrs->nice) == -1 && errno != 0) {
+                perror("nice");
+                _exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; attrs && i < attrs->n_rlimits; i++) {
+            if (prlimit(0, attrs->rlimits[i].resource, &attrs->rlimits[i].limit, NULL) != 0) {
+                perror("ulimit");
+                _exit(EXIT_FAILURE);
+            }
+        }
+        if (attrs && attrs->policy >= 0) {
+            struct sched_param param = { .sched_priority = attrs->priority };
+            if (sched_setscheduler(0, attrs->policy, &param) != 0) {
+                perror("sched");
+                _exit(EXIT_FAILURE);
+            }
+        }
+        // Pin the child to its CPU before exec so the program never runs elsewhere.
+        if (attrs && attrs->cpu >= 0 && !attrs->has_affinity) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(attrs->cpu, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) != 0)
+                perror("sched_setaffinity");
+        }
+        // Prefer the job's NUMA node for its memory; the kernel falls back to other nodes
+        // when that one is full, unlike a strict MPOL_BIND.
+        if (attrs && attrs->numa_node >= 0) {
+            unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+            mask[attrs->numa_node / (8 * sizeof(unsigned long))] |= 1UL << (attrs->numa_node % (8 * sizeof(unsigned long)));
+            if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NUMA_NODES + 1) != 0)
+                perror("set_mempolicy");
+        }
+        // Let the process substitution pipes named by /dev/fd/N survive the exec.
+        for (int i = 0; attrs && i < attrs->n_pass_fds; i++)
+            fcntl(attrs->pass_fds[i], F_SETFD, 0);
+        // Execute the command using execvp; if it fails, print error and exit.
+        if (execvp(tokens[0], tokens) == -1) {
+            report_exec_failure(err_pipe[1]);
+            perror("execvp");
+        }
+        _exit(EXEC_FAILED);  // Exit if execution fails (without flushing the shell's stdio buffers).
+    }
+    // Parent process branch.
+    if (job_control.terminal) {
+        setpgid(pid, pgid ? pgid : pid);
+        if (kind == JOB_FOREGROUND && pgid == 0)
+            tcsetpgrp(STDIN_FILENO, pid);
+    }
+    if (gate[0] >= 0) {
+        close(gate[0]);
+        attrs->on_launch(pid, attrs->on_launch_arg);
+        close(gate[1]);  // Releases the child into exec.
+    }
+    collect_exec_result(err_pipe);
+    char *command = join_tokens(tokens);
+    struct job *job = add_job(pid, command, kind);
+    if (job) {
+        job->start = start;
+        job->cpu = attrs ? attrs->cpu : -1;
+        job->numa_node = attrs ? attrs->numa_node : -1;
+        job->pgid = !job_control.terminal ? 0 : pgid ? pgid : pid;
+        if (attrs && attrs->timeout > 0)
+            start_job_timeout(job, attrs->timeout, attrs->kill_after);
+        if (attrs && attrs->cgroup_fd >= 0)
+            job->cgroup_fd = fcntl(attrs->cgroup_fd, F_DUPFD_CLOEXEC, 0);
+    } else if (attrs && attrs->cgroup_fd >= 0) {
+        release_untracked_cgroup(attrs->cgroup_fd);
+    }
+    free(command);
+    return pid;
+}
+
+//-------------------------------------------------------------
+// now_seconds: Returns a monotonic timestamp in seconds, for measuring durations.
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//-------------------------------------------------------------
+// free_tokens: Frees every string in a NULL-terminated token array, then the array.
+void free_tokens(char **tokens) {
+    for (int i = 0; tokens[i] != NULL; i++)
+        free(tokens[i]);
+    free(tokens);
+}
+
+//-------------------------------------------------------------
+// join_tokens: Returns a newly allocated string of the tokens separated by spaces.
+char *join_tokens(char **tokens) {
+    size_t len = 1;
+    for (int i = 0; tokens[i] != NULL; i++)
+        len += strlen(tokens[i]) + 1;
+    char *text = malloc(len);
+    if (!text) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    text[0] = '\0';
+    char *p = text;
+    for (int i = 0; tokens[i] != NULL; i++) {
+        if (i > 0)
+            *p++ = ' ';
+        p = stpcpy(p, tokens[i]);
+    }
+    return text;
+}
+
+//-------------------------------------------------------------
+// block_sigchld: Blocks SIGCHLD and stores the previous signal mask in old.
+// The job table may only be modified while SIGCHLD is blocked.
+void block_sigchld(sigset_t *old) {
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, old);
+}
+
+//-------------------------------------------------------------
+// add_job: Records a newly forked child in the first free job slot.
+// Must be called with SIGCHLD blocked. Returns NULL if the table is full,
+// in which case the child is still reaped (but not tracked) by on_child_exit().
+struct job *add_job(pid_t pid, const char *command, int kind) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *job = &job_table[i];
+        if (job->state != JOB_FREE)
+            continue;
+        job->id = i + 1;
+        job->pid = pid;
+        job->status = 0;
+        job->kind = kind;
+        job->start = now_seconds();
+        job->cpu = -1;
+        job->cgroup_fd = -1;
+        job->numa_node = -1;
+        job->pid_fd = -1;
+        job->timeout = job->kill_after = job->deadline = 0;
+        job->timeout_signal = 0;
+        job->pgid = 0;
+        job->stopped = 0;
+        job->supervisor = 0;
+        job->restarts = 0;
+        job->command = strdup(command);
+        job->state = JOB_RUNNING;
+        return job;
+    }
+    fprintf(stderr, "job table full; pid %d is not tracked\n", (int)pid);
+    return NULL;
+}
+
+//-------------------------------------------------------------
+// find_job: Returns the job entry for pid, or NULL if it is not tracked.
+// Safe to call from on_child_exit() because entries only change with SIGCHLD blocked.
+struct job *find_job(pid_t pid) {
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (job_table[i].state != JOB_FREE && job_table[i].pid == pid)
+            return &job_table[i];
+    return NULL;
+}
+
+//-------------------------------------------------------------
+// wait_for_child: Waits for a child started with SIGCHLD blocked and returns its wait status
+// (-1 on error); result, if not NULL, also receives its rusage and wall time.
+// Tracked children are reaped by on_child_exit() while we sleep in sigsuspend() with the
+// caller's original mask; untracked ones are waited for directly. A foreground job that is
+// stopped (^Z) becomes a background job and its stop status is returned.
+int wait_for_child(pid_t pid, struct job *job, const sigset_t *old, struct child_result *result) {
+    struct child_result r;
+    memset(&r, 0, sizeof(r));
+    double span = trace_clock();
+    if (job == NULL) {
+        double start = now_seconds();
+        while (wait4(pid, &r.status, 0, &r.usage) == -1) {
+            if (errno != EINTR) {
+                perror("waitpid");
+                r.status = -1;
+                break;
+            }
+        }
+        trace_record("waitpid", span, trace_clock(), pid);
+        if (r.status != -1) {
+            note_child_reaped();
+            append_exit_record(pid, r.status, &r.usage, NULL);
+            span = trace_clock();
+            log_child_termination();
+            trace_record("log_write", span, trace_clock(), pid);
+        }
+        r.wall = now_seconds() - start;
+    } else {
+        while (job->state == JOB_RUNNING && !(job->stopped && job->kind == JOB_FOREGROUND))
+            wait_for_sigchld(old);
+        trace_record("waitpid", span, trace_clock(), pid);
+        // Take the terminal back, unless other members of the job's group (parallel) still
+        // run in it or a newer group was handed it meanwhile.
+        if (job->kind == JOB_FOREGROUND && job_control.terminal &&
+            tcgetpgrp(STDIN_FILENO) == job->pgid && !job_group_busy(job))
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        r.status = job->status;
+        if (job->state == JOB_RUNNING) {
+            job->kind = JOB_BACKGROUND;
+            fprintf(stderr, "[%d] Stopped  %s  (kill -CONT %%%d resumes it in the background)\n",
+                    job->id, job->command, job->id);
+        } else {
+            r.usage = job->usage;
+            r.wall = job->end - job->start;
+            release_job(job);
+        }
+    }
+    if (result)
+        *result = r;
+    return r.status;
+}
+
+//-------------------------------------------------------------
+// release_job: Frees a job entry. Must be called with SIGCHLD blocked.
+void release_job(struct job *job) {
+    if (job->state == JOB_DONE && job->kind != JOB_HELPER) {
+        hist_record(&stats.wall, job->end - job->start);
+        hist_record(&stats.reap, now_seconds() - job->end);
+    }
+    if (job->cgroup_fd >= 0)
+        finish_job_cgroup(job);
+    if (job->pid_fd >= 0)
+        close(job->pid_fd);
+    job->pid_fd = -1;
+    job->deadline = 0;
+    free(job->command);
+    job->command = NULL;
+    job->state = JOB_FREE;
+}
+
+//-------------------------------------------------------------
+// reap_finished_jobs: Releases the table entries of background jobs that on_child_exit()
+// has marked as finished, and lets "supervise" schedule restarts of its jobs.
+void reap_finished_jobs(void) {
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *job = &job_table[i];
+        if (job->state == JOB_DONE && job->kind != JOB_FOREGROUND)
+            finish_background_job(job);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//-------------------------------------------------------------
+// reap_supervised_jobs: Like reap_finished_jobs(), but only for supervised jobs, which no
+// command waits on. wait_for_sigchld() calls it so a helper that exits while a foreground
+// command runs is rescheduled then, not when the shell next reads input.
+void reap_supervised_jobs(void) {
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *job = &job_table[i];
+        if (job->state == JOB_DONE && job->kind != JOB_FOREGROUND && job->supervisor)
+            finish_background_job(job);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//-------------------------------------------------------------
+// finish_background_job: Charges a finished job's run time to the CPU queue it was pinned
+// to, hands supervised jobs to their supervisor and frees the entry (SIGCHLD blocked).
+void finish_background_job(struct job *job) {
+    for (int c = 0; c < cpu_sched.n_cores; c++)
+        if (job->cpu == cpu_sched.cores[c].cpu)
+            cpu_sched.cores[c].busy += job->end - job->start;
+    if (job->supervisor)
+        supervised_job_exited(job);
+    release_job(job);
+}
+
+//-------------------------------------------------------------
+// job_group_busy: Returns 1 if another running job shares job's process group.
+int job_group_busy(const struct job *job) {
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (&job_table[i] != job && job_table[i].state == JOB_RUNNING && job_table[i].pgid == job->pgid)
+            return 1;
+    return 0;
+}
+
+//-------------------------------------------------------------
+// count_background_jobs: Returns how many '&' jobs are still running.
+int count_background_jobs(void) {
+    int n = 0;
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (job_table[i].state == JOB_RUNNING && job_table[i].kind == JOB_BACKGROUND)
+            n++;
+    return n;
+}
+
+//-------------------------------------------------------------
+// enqueue_command: Appends a background command to the global admission queue.
+void enqueue_command(char **tokens, struct launch_attrs *attrs) {
+    fifo_push(&job_queue.pending, make_queued_command(tokens, attrs));
+    if (psi_pressured())
+        fprintf(stderr, "[q%d] queued (pressure stall)\n", job_queue.pending.depth);
+    else
+        fprintf(stderr, "[q%d] queued (maxjobs=%d reached)\n", job_queue.pending.depth, job_queue.max_jobs);
+}
+
+//-------------------------------------------------------------
+// make_queued_command: Builds a queue entry for a command. The tokens are copied; the
+// descriptors in attrs move to the entry (their numbers appear in /dev/fd/N arguments)
+// and attrs is reset so the caller's release does not close them.
+struct queued_command *make_queued_command(char **tokens, struct launch_attrs *attrs) {
+    struct queued_command *q = malloc(sizeof(*q));
+    int n = 0;
+    while (tokens[n] != NULL)
+        n++;
+    if (q)
+        q->argv = malloc((n + 1) * sizeof(char *));
+    if (!q || !q->argv) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++)
+        q->argv[i] = strdup(tokens[i]);
+    q->argv[n] = NULL;
+    init_launch_attrs(&q->attrs);
+    if (attrs) {
+        q->attrs = *attrs;
+        init_launch_attrs(attrs);
+    }
+    q->enqueued = now_seconds();
+    q->next = NULL;
+    return q;
+}
+
+//-------------------------------------------------------------
+// fifo_push: Appends q to the tail of fifo.
+void fifo_push(struct command_fifo *fifo, struct queued_command *q) {
+    q->next = NULL;
+    if (fifo->tail)
+        fifo->tail->next = q;
+    else
+        fifo->head = q;
+    fifo->tail = q;
+    fifo->depth++;
+}
+
+//-------------------------------------------------------------
+// fifo_pop: Removes and returns the oldest entry of fifo, or NULL if it is empty.
+struct queued_command *fifo_pop(struct command_fifo *fifo) {
+    struct queued_command *q = fifo->head;
+    if (q == NULL)
+        return NULL;
+    fifo->head = q->next;
+    if (fifo->head == NULL)
+        fifo->tail = NULL;
+    fifo->depth--;
+    return q;
+}
+
+//-------------------------------------------------------------
+// start_queued_command: Launches a queued command as a background job (pinned to cpu
+// unless it is -1), records how long it waited, and frees the entry.
+void start_queued_command(struct queued_command *q, int cpu) {
+    double waited = now_seconds() - q->enqueued;
+    job_queue.dispatched++;
+    job_queue.total_wait += waited;
+    if (waited > job_queue.max_wait)
+        job_queue.max_wait = waited;
+    q->attrs.cpu = cpu;
+    launch_command(q->argv, JOB_BACKGROUND, &q->attrs);
+    release_launch_attrs(&q->attrs);
+    free_tokens(q->argv);
+    free(q);
+}
+
+//-------------------------------------------------------------
+// background_slot_free: Returns 1 if maxjobs (and PSI, when enabled) allow one more '&' job
+// to start.
+int background_slot_free(void) {
+    if (psi_pressured())
+        return 0;
+    return job_queue.max_jobs == 0 || count_background_jobs() < job_queue.max_jobs;
+}
+
+//-------------------------------------------------------------
+// dispatch_job_queue: Starts queued background commands, oldest first, while the number of
+// running '&' jobs is below maxjobs. Called whenever a child exits or the limit changes.
+// In sched=cpu mode each CPU with a free slot first takes from its own queue and, if that
+// is empty, steals the oldest job from the longest other queue.
+void dispatch_job_queue(void) {
+    sigset_t old;
+    block_sigchld(&old);
+    for (int c = 0; c < cpu_sched.n_cores; c++) {
+        struct core_queue *core = &cpu_sched.cores[c];
+        while (count_core_jobs(core->cpu) < cpu_sched.slots && background_slot_free()) {
+            struct queued_command *q = fifo_pop(&core->pending);
+            if (q == NULL) {
+                struct core_queue *victim = NULL;
+                for (int v = 0; v < cpu_sched.n_cores; v++)
+                    if (cpu_sched.cores[v].pending.depth > 0 &&
+                        (victim == NULL || cpu_sched.cores[v].pending.depth > victim->pending.depth))
+                        victim = &cpu_sched.cores[v];
+                if (victim == NULL)
+                    break;
+                q = fifo_pop(&victim->pending);
+                core->stolen++;
+            }
+            core->launched++;
+            start_queued_command(q, core->cpu);
+        }
+    }
+    while (job_queue.pending.head != NULL && background_slot_free())
+        start_queued_command(fifo_pop(&job_queue.pending), -1);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//-------------------------------------------------------------
+// set_cpu_sched: Enables the CPU-affine scheduler with one run queue per CPU in the
+// shell's affinity mask, or disables it, moving still-queued jobs to the global FIFO.
+// Returns 0 on success, -1 on failure.
+int set_cpu_sched(int enable) {
+    sigset_t old;
+    block_sigchld(&old);
+    if (!enable) {
+        for (int c = 0; c < cpu_sched.n_cores; c++) {
+            struct queued_command *q;
+            while ((q = fifo_pop(&cpu_sched.cores[c].pending)) != NULL)
+                fifo_push(&job_queue.pending, q);
+        }
+        free(cpu_sched.cores);
+        cpu_sched.cores = NULL;
+        cpu_sched.n_cores = 0;
+        cpu_sched.enabled = 0;
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        dispatch_job_queue();
+        return 0;
+    }
+    if (cpu_sched.enabled) {
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return 0;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return -1;
+    }
+    cpu_sched.cores = calloc(CPU_COUNT(&allowed), sizeof(struct core_queue));
+    if (!cpu_sched.cores) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    cpu_sched.n_cores = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        struct core_queue *core = &cpu_sched.cores[cpu_sched.n_cores++];
+        core->cpu = cpu;
+        read_cpu_stat(cpu, &core->stat_busy, &core->stat_total);
+    }
+    cpu_sched.since = now_seconds();
+    cpu_sched.enabled = 1;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+//-------------------------------------------------------------
+// schedule_on_core: Places a '&' job on the CPU with the fewest running plus queued jobs.
+// It starts right away, pinned to that CPU, if the CPU has a free slot and an empty queue
+// (and maxjobs allows); otherwise it waits in that CPU's queue. Called with SIGCHLD blocked.
+void schedule_on_core(char **tokens, struct launch_attrs *attrs) {
+    struct core_queue *best = NULL;
+    int best_load = 0;
+    for (int c = 0; c < cpu_sched.n_cores; c++) {
+        struct core_queue *core = &cpu_sched.cores[c];
+        int load = count_core_jobs(core->cpu) + core->pending.depth;
+        if (best == NULL || load < best_load) {
+            best = core;
+            best_load = load;
+        }
+    }
+    if (best->pending.depth == 0 && count_core_jobs(best->cpu) < cpu_sched.slots &&
+        background_slot_free()) {
+        struct launch_attrs pinned;
+        if (attrs)
+            pinned = *attrs;
+        else
+            init_launch_attrs(&pinned);
+        pinned.cpu = best->cpu;
+        best->launched++;
+        launch_command(tokens, JOB_BACKGROUND, &pinned);
+        return;
+    }
+    fifo_push(&best->pending, make_queued_command(tokens, attrs));
+    fprintf(stderr, "[cpu%d q%d] queued\n", best->cpu, best->pending.depth);
+}
+
+//-------------------------------------------------------------
+// count_core_jobs: Returns how many running '&' jobs are pinned to cpu.
+int count_core_jobs(int cpu) {
+    int n = 0;
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (job_table[i].state == JOB_RUNNING && job_table[i].kind == JOB_BACKGROUND &&
+            job_table[i].cpu == cpu)
+            n++;
+    return n;
+}
+
+//-------------------------------------------------------------
+// read_cpu_stat: Reads the busy and total jiffies of one CPU from /proc/stat.
+// Returns 0 on success, -1 if the CPU's line cannot be read.
+int read_cpu_stat(int cpu, unsigned long long *busy, unsigned long long *total) {
+    FILE *f = fopen("/proc/stat", "r");
+    char line[256];
+    char name[16];
+    int found = -1;
+    *busy = *total = 0;
+    if (!f)
+        return -1;
+    snprintf(name, sizeof(name), "cpu%d ", cpu);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, name, strlen(name)) != 0)
+            continue;
+        unsigned long long v[8] = { 0 };
+        sscanf(line + strlen(name), "%llu %llu %llu %llu %llu %llu %llu %llu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+        for (int k = 0; k < 8; k++)
+            *total += v[k];
+        *busy = *total - v[3] - v[4];  // Everything except idle and iowait.
+        found = 0;
+        break;
+    }
+    fclose(f);
+    return found;
+}
+
+//-------------------------------------------------------------
+// print_cpu_sched: Prints one line per CPU run queue: running and queued jobs, how many
+// were launched and stolen there, the wall time of its finished jobs, and the CPU's
+// utilization (from /proc/stat) since the scheduler was enabled.
+void print_cpu_sched(FILE *out) {
+    fprintf(out, "cpu  running queued launched stolen  job-time   util  (sched=cpu, coreslots=%d, %.1fs)\n",
+            cpu_sched.slots, now_seconds() - cpu_sched.since);
+    for (int c = 0; c < cpu_sched.n_cores; c++) {
+        struct core_queue *core = &cpu_sched.cores[c];
+        unsigned long long busy, total;
+        double util = 0;
+        if (read_cpu_stat(core->cpu, &busy, &total) == 0 && total > core->stat_total)
+            util = 100.0 * (busy - core->stat_busy) / (total - core->stat_total);
+        fprintf(out, "%3d  %7d %6d %8ld %6ld %8.1fs %5.1f%%\n", core->cpu, count_core_jobs(core->cpu),
+                core->pending.depth, core->launched, core->stolen, core->busy, util);
+    }
+}
+
+//-------------------------------------------------------------
+// wait_for_sigchld: Sleeps (SIGCHLD unblocked via the caller's saved mask) until a child
+// exits or an event source is ready, then schedules restarts of supervised jobs that exited
+// and lets queued background commands take any freed slots. Callers re-check their child's
+// state and call again as needed.
+void wait_for_sigchld(const sigset_t *old) {
+    sigset_t mask = *old;
+    sigdelset(&mask, SIGCHLD);
+    struct pollfd fds[MAX_EVENT_SOURCES];
+    int n = fill_event_pollfds(fds);
+    if (n == 0) {
+        sigsuspend(&mask);
+    } else if (ppoll(fds, n, NULL, &mask) > 0) {
+        // Keep event sources (e.g. metrics scrapes) served while a foreground command runs.
+        service_event_sources(fds, n);
+    }
+    reap_supervised_jobs();
+    dispatch_job_queue();
+}
+
+//-------------------------------------------------------------
+// setup_event_loop: Creates the non-blocking self-pipe that on_child_exit() writes to,
+// so a child exiting while the shell waits for input is handled immediately.
+void setup_event_loop(void) {
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("pipe");
+        sigchld_pipe[0] = sigchld_pipe[1] = -1;
+    }
+}
+
+//-------------------------------------------------------------
+// wait_for_input: The shell's event loop. Blocks in poll() until stdin is readable;
+// meanwhile every wake-up from on_child_exit() releases finished background jobs and
+// starts queued commands into the freed slots, and registered event sources are serviced.
+void wait_for_input(void) {
+    struct pollfd fds[2 + MAX_EVENT_SOURCES] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = sigchld_pipe[0], .events = POLLIN },
+    };
+    while (1) {
+        // Rebuilt every time: handlers add and remove sources.
+        int n = 2 + fill_event_pollfds(fds + 2);
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return;
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+            reap_finished_jobs();
+            dispatch_job_queue();
+        }
+        service_event_sources(fds + 2, n - 2);
+        if (fds[0].revents)
+            return;
+    }
+}
+
+//-------------------------------------------------------------
+// read_input_line: Reads one line of input (including its '\n') into *line, growing it as
+// needed like getline(). Data is read from stdin in large chunks into a private buffer,
+// waiting in wait_for_input() whenever no complete line is buffered.
+// Returns the line length, or -1 at end of input.
+ssize_t read_input_line(char **line, size_t *cap) {
+    static char *buf = NULL;
+    static size_t buf_cap = 0, buf_len = 0, buf_pos = 0;
+    static int at_eof = 0;
+
+    if (buf == NULL) {
+        // Allocate up front: the scan and memmove below must never see a NULL buffer.
+        buf_cap = SUBST_CHUNK;
+        buf = malloc(buf_cap);
+        if (!buf) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while (1) {
+        char *start = buf + buf_pos;
+        char *nl = memchr(start, '\n', buf_len - buf_pos);
+        if (nl != NULL || at_eof) {
+            size_t n = nl ? (size_t)(nl - start) + 1 : buf_len - buf_pos;
+            if (n == 0) {
+                // Interactive users may keep going after Ctrl-D ends a here-document.
+                at_eof = !isatty(STDIN_FILENO);
+                return -1;
+            }
+            if (*cap < n + 1) {
+                *cap = n + 1;
+                *line = realloc(*line, *cap);
+                if (!*line) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memcpy(*line, start, n);
+            (*line)[n] = '\0';
+            buf_pos += n;
+            return n;
+        }
+
+        // Move unread data to the front and make room for another large read.
+        memmove(buf, start, buf_len - buf_pos);
+        buf_len -= buf_pos;
+        buf_pos = 0;
+        if (buf_cap - buf_len < MAX_LINE) {
+            buf_cap *= 2;
+            buf = realloc(buf, buf_cap);
+            if (!buf) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        wait_for_input();
+        ssize_t r = read(STDIN_FILENO, buf + buf_len, buf_cap - buf_len);
+        if (r > 0)
+            buf_len += r;
+        else if (r == 0 || (errno != EINTR && errno != EAGAIN))
+            at_eof = 1;
+    }
+}
+
+//-------------------------------------------------------------
+// setup_trace: If MYSHELL_TRACE is set, creates the output file (relative to the directory the
+// shell was started in) and allocates the span buffer; the file is written by dump_trace().
+void setup_trace(void) {
+    const char *path = getenv("MYSHELL_TRACE");
+    if (path == NULL || *path == '\0')
+        return;
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace.fd < 0) {
+        perror(path);
+        return;
+    }
+    trace.spans = calloc(TRACE_CAPACITY, sizeof(struct trace_span));
+    if (trace.spans == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    trace.owner = getpid();
+    atexit(dump_trace);
+}
+
+//-------------------------------------------------------------
+// trace_clock: Timestamp for a span boundary. Returns 0 without reading the clock when
+// tracing is off, so untraced shells pay only a branch per span.
+double trace_clock(void) {
+    return trace.spans ? now_seconds() : 0;
+}
+
+//-------------------------------------------------------------
+// trace_record: Stores one span. Async-signal-safe and lock-free: the slot index comes from an
+// atomic increment and the name is published last, so dump_trace() skips half-written slots.
+void trace_record(const char *name, double start, double end, pid_t pid) {
+    if (trace.spans == NULL)
+        return;
+    unsigned long i = __atomic_fetch_add(&trace.next, 1, __ATOMIC_RELAXED);
+    if (i >= TRACE_CAPACITY)
+        return;  // Full: counted as dropped.
+    trace.spans[i].start = start;
+    trace.spans[i].end = end;
+    trace.spans[i].pid = pid;
+    __atomic_store_n(&trace.spans[i].name, name, __ATOMIC_RELEASE);
+}
+
+//-------------------------------------------------------------
+// dump_trace: Writes the recorded spans in Chrome trace-event format ("X" complete events, in
+// microseconds), loadable in Perfetto or chrome://tracing. Shell phases go on the shell's own
+// track; spans that belong to a child (fork, exec_to_exit, waitpid, log_write) carry its PID
+// in args, and exec_to_exit gets one track per child.
+void dump_trace(void) {
+    if (trace.spans == NULL || getpid() != trace.owner)
+        return;
+    // Keep the handler from recording while the buffer is being written out.
+    sigset_t old;
+    block_sigchld(&old);
+    FILE *out = fdopen(trace.fd, "w");
+    if (out == NULL) {
+        perror("MYSHELL_TRACE");
+        close(trace.fd);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return;
+    }
+    pid_t shell_pid = trace.owner;
+    unsigned long n = trace.next < TRACE_CAPACITY ? trace.next : TRACE_CAPACITY;
+    fprintf(out, "{\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"myshell\"}},\n", shell_pid);
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"shell\"}}",
+            shell_pid, shell_pid);
+    for (unsigned long i = 0; i < n; i++) {
+        const struct trace_span *span = &trace.spans[i];
+        const char *name = __atomic_load_n(&span->name, __ATOMIC_ACQUIRE);
+        if (name == NULL)
+            continue;
+        int tid = strcmp(name, "exec_to_exit") == 0 ? span->pid : shell_pid;
+        fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                name, span->start * 1e6, (span->end - span->start) * 1e6, shell_pid, tid);
+        if (span->pid)
+            fprintf(out, ",\"args\":{\"child\":%d}", span->pid);
+        fputc('}', out);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_spans\":%lu}}\n",
+            trace.next - n);
+    fclose(out);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//-------------------------------------------------------------
+// hist_record: Adds one duration (in seconds) to h. Negative durations count as 0.
+void hist_record(struct histogram *h, double seconds) {
+    uint64_t v = seconds > 0 ? (uint64_t)(seconds * 1e9) : 0;
+    int index = v;
+    if (v >= (1u << HIST_SUB_BITS)) {
+        // Top HIST_SUB_BITS + 1 bits select the bucket within v's power of two.
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - HIST_SUB_BITS;
+        index = ((shift + 1) << HIST_SUB_BITS) + (int)(v >> shift) - (1 << HIST_SUB_BITS);
+    }
+    h->buckets[index]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+//-------------------------------------------------------------
+// hist_percentile: Returns the upper edge (in ns) of the bucket holding the q-th quantile
+// (clamped to the maximum seen), or 0 for an empty histogram.
+uint64_t hist_percentile(const struct histogram *h, double q) {
+    if (h->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen <= rank)
+            continue;
+        if (i < (1 << HIST_SUB_BITS))
+            return i;
+        int shift = (i >> HIST_SUB_BITS) - 1;
+        uint64_t sub = (i & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS);
+        uint64_t upper = ((sub + 1) << shift) - 1;
+        return upper < h->max ? upper : h->max;
+    }
+    return h->max;
+}
+
+//-------------------------------------------------------------
+// builtin_stats: stats
+// Prints count, p50/p90/p99/p999 and max (in microseconds) for spawn latency, command wall
+// time, parse time and reap delay since the previous "stats" (or shell start), then resets.
+void builtin_stats(FILE *out) {
+    const struct {
+        const char *name;
+        struct histogram *h;
+    } rows[] = {
+        { "spawn", &stats.spawn },
+        { "wall", &stats.wall },
+        { "parse", &stats.parse },
+        { "reap", &stats.reap },
+    };
+    // Fold in jobs that finished while the shell was busy, so their reap delay is counted now.
+    reap_finished_jobs();
+    double now = now_seconds();
+    fprintf(out, "stats over %.1fs (microseconds)\n", now - stats.since);
+    fprintf(out, "%-8s %10s %10s %10s %10s %10s %10s\n", "metric", "count", "p50", "p90", "p99", "p999", "max");
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+        const struct histogram *h = rows[i].h;
+        fprintf(out, "%-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", rows[i].name,
+                (unsigned long long)h->count, hist_percentile(h, 0.50) / 1e3,
+                hist_percentile(h, 0.90) / 1e3, hist_percentile(h, 0.99) / 1e3,
+                hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+        memset(rows[i].h, 0, sizeof(*rows[i].h));
+    }
+    stats.since = now;
+}
+
+//-------------------------------------------------------------
+// add_event_source: Has the event loop call handler(fd, revents, arg) whenever poll() reports
+// one of events on fd. Returns 0, or -1 if MAX_EVENT_SOURCES are already registered.
+int add_event_source(int fd, short events, void (*handler)(int, short, void *), void *arg) {
+    if (n_event_sources == MAX_EVENT_SOURCES)
+        return -1;
+    event_sources[n_event_sources++] = (struct event_source){ fd, events, handler, arg };
+    return 0;
+}
+
+//-------------------------------------------------------------
+// remove_event_source: Stops watching fd (the caller closes it).
+void remove_event_source(int fd) {
+    for (int i = 0; i < n_event_sources; i++) {
+        if (event_sources[i].fd == fd) {
+            event_sources[i] = event_sources[--n_event_sources];
+            return;
+        }
+    }
+}
+
+//-------------------------------------------------------------
+// fill_event_pollfds: Writes one pollfd per event source into fds and returns how many.
+int fill_event_pollfds(struct pollfd *fds) {
+    for (int i = 0; i < n_event_sources; i++) {
+        fds[i].fd = event_sources[i].fd;
+        fds[i].events = event_sources[i].events;
+        fds[i].revents = 0;
+    }
+    return n_event_sources;
+}
+
+//-------------------------------------------------------------
+// service_event_sources: Calls the handler of every source that poll() marked ready. Sources
+// are looked up by fd, since an earlier handler may have removed (or replaced) one.
+void service_event_sources(const struct pollfd *fds, int n) {
+    for (int i = 0; i < n; i++) {
+        if (fds[i].revents == 0)
+            continue;
+        for (int j = 0; j < n_event_sources; j++) {
+            if (event_sources[j].fd == fds[i].fd) {
+                event_sources[j].handler(fds[i].fd, fds[i].revents, event_sources[j].arg);
+                break;
+            }
+        }
+    }
+}
+
+//-------------------------------------------------------------
+// note_child_reaped: Counts one reaped child. Async-signal-safe (called from on_child_exit).
+void note_child_reaped(void) {
+    __atomic_fetch_add(&metrics.reaped, 1, __ATOMIC_RELAXED);
+}
+
+//-------------------------------------------------------------
+// report_exec_failure: Called in a child whose execvp() failed, before anything else can
+// change errno: writes errno to the close-on-exec error pipe (fd), whose EOF alone tells the
+// parent that the exec succeeded.
+void report_exec_failure(int fd) {
+    int err = errno;
+    if (fd >= 0)
+        write(fd, &err, sizeof(err));
+    errno = err;
+}
+
+//-------------------------------------------------------------
+// collect_exec_result: Parent side of the error pipe: closes the write end and waits until
+// the child has exec'd (EOF) or reported a failed execvp(), which is counted as a failed exec.
+// A child exiting 127 on its own is not. Returns the child's errno, or 0.
+int collect_exec_result(int err_pipe[2]) {
+    if (err_pipe[0] < 0)
+        return 0;
+    close(err_pipe[1]);
+    int err = 0;
+    ssize_t n;
+    while ((n = read(err_pipe[0], &err, sizeof(err))) < 0 && errno == EINTR)
+        ;
+    close(err_pipe[0]);
+    err_pipe[0] = err_pipe[1] = -1;
+    if (n != sizeof(err))
+        return 0;
+    __atomic_fetch_add(&metrics.failed_execs, 1, __ATOMIC_RELAXED);
+    return err;
+}
+
+//-------------------------------------------------------------
+// setup_metrics: If MYSHELL_METRICS is set, listens on that Unix socket path (relative to the
+// directory the shell was started in). A stale socket left by an earlier shell is replaced.
+void setup_metrics(void) {
+    const char *path = getenv("MYSHELL_METRICS");
+    if (path == NULL || *path == '\0')
+        return;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "MYSHELL_METRICS: socket path too long: %s\n", path);
+        return;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return;
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, MAX_METRICS_CLIENTS) != 0) {
+        perror(path);
+        close(fd);
+        return;
+    }
+    metrics.path = realpath(path, NULL);  // Absolute, since the shell changes directory.
+    metrics.listen_fd = fd;
+    metrics.owner = getpid();
+    for (int i = 0; i < MAX_METRICS_CLIENTS; i++)
+        metrics.clients[i].fd = -1;
+    add_event_source(fd, POLLIN, accept_metrics_client, NULL);
+    atexit(remove_metrics_socket);
+}
+
+//-------------------------------------------------------------
+// accept_metrics_client: Accepts pending connections on the metrics socket and watches each
+// for its request. Connections beyond MAX_METRICS_CLIENTS are closed unanswered.
+void accept_metrics_client(int fd, short revents, void *arg) {
+    (void)revents;
+    (void)arg;
+    int client;
+    while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct metrics_client *slot = NULL;
+        for (int i = 0; i < MAX_METRICS_CLIENTS && !slot; i++)
+            if (metrics.clients[i].fd < 0)
+                slot = &metrics.clients[i];
+        if (slot == NULL || add_event_source(client, POLLIN, serve_metrics_client, slot) != 0) {
+            close(client);
+            continue;
+        }
+        slot->fd = client;
+        slot->len = 0;
+    }
+}
+
+//-------------------------------------------------------------
+// serve_metrics_client: Collects the client's request without blocking. An HTTP request
+// (complete at its blank line) gets an HTTP/1.0 response; a client that just connects and
+// shuts down its write side gets the bare exposition text. The connection is then closed.
+void serve_metrics_client(int fd, short revents, void *arg) {
+    struct metrics_client *client = arg;
+    int done = (revents & (POLLERR | POLLNVAL)) != 0;
+    while (!done) {
+        ssize_t n = read(fd, client->request + client->len, sizeof(client->request) - 1 - client->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;  // Wait for the rest of the request.
+        if (n <= 0)
+            break;  // EOF (or error): answer with what we have.
+        client->len += n;
+        client->request[client->len] = '\0';
+        if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n") ||
+            client->len == sizeof(client->request) - 1)
+            break;
+    }
+    if (!done) {
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *out = open_memstream(&body, &body_len);
+        if (out) {
+            write_metrics(out);
+            fclose(out);
+            char header[160];
+            int header_len = 0;
+            if (client->len > 0)
+                header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                      "Content-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: %zu\r\n\r\n", body_len);
+            // A fresh socket buffer holds the whole response; a short write just truncates it.
+            if (write(fd, header, header_len) == header_len)
+                write(fd, body, body_len);
+            free(body);
+        }
+    }
+    remove_event_source(fd);
+    close(fd);
+    client->fd = -1;
+}
+
+//-------------------------------------------------------------
+// write_metrics: Writes the shell's counters and gauges in Prometheus text exposition format.
+void write_metrics(FILE *out) {
+    static const char *kinds[] = { "foreground", "background", "helper" };
+    int running[3] = { 0, 0, 0 };
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (job_table[i].state == JOB_RUNNING && job_table[i].kind >= 0 && job_table[i].kind < 3)
+            running[job_table[i].kind]++;
+    int queued = job_queue.pending.depth;
+    for (int c = 0; c < cpu_sched.n_cores; c++)
+        queued += cpu_sched.cores[c].pending.depth;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    fprintf(out, "# HELP myshell_children_spawned_total Child processes forked by the shell.\n"
+            "# TYPE myshell_children_spawned_total counter\n"
+            "myshell_children_spawned_total %lu\n", metrics.spawned);
+    fprintf(out, "# HELP myshell_children_reaped_total Child processes collected with wait4().\n"
+            "# TYPE myshell_children_reaped_total counter\n"
+            "myshell_children_reaped_total %lu\n", __atomic_load_n(&metrics.reaped, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP myshell_exec_failures_total Children whose execvp() failed.\n"
+            "# TYPE myshell_exec_failures_total counter\n"
+            "myshell_exec_failures_total %lu\n", __atomic_load_n(&metrics.failed_execs, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP myshell_log_bytes_total Bytes written to the termination log.\n"
+            "# TYPE myshell_log_bytes_total counter\n"
+            "myshell_log_bytes_total %lu\n", __atomic_load_n(&metrics.log_bytes, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP myshell_jobs_running Children currently running, by kind.\n"
+            "# TYPE myshell_jobs_running gauge\n");
+    for (int k = 0; k < 3; k++)
+        fprintf(out, "myshell_jobs_running{kind=\"%s\"} %d\n", kinds[k], running[k]);
+    fprintf(out, "# HELP myshell_jobs_queued Background commands waiting for a maxjobs slot.\n"
+            "# TYPE myshell_jobs_queued gauge\n"
+            "myshell_jobs_queued %d\n", queued);
+}
+
+//-------------------------------------------------------------
+// remove_metrics_socket: Unlinks the metrics socket when the shell exits.
+void remove_metrics_socket(void) {
+    if (metrics.path && getpid() == metrics.owner)
+        unlink(metrics.path);
+}
+
+//-------------------------------------------------------------
+// setup_exit_log: If MYSHELL_EXITLOG is set, opens that binary log (and its ".idx" sparse
+// index) for appending. Relative paths are taken from the directory the shell started in.
+void setup_exit_log(void) {
+    const char *path = getenv("MYSHELL_EXITLOG");
+    if (path == NULL || *path == '\0')
+        return;
+    exit_log.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (exit_log.fd < 0) {
+        perror(path);
+        return;
+    }
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    exit_log.index_fd = open(index_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (exit_log.index_fd < 0)
+        perror(index_path);  // The log still works; queries just scan from the start.
+    exit_log.path = realpath(path, NULL);
+}
+
+//-------------------------------------------------------------
+// hash_command: 32-bit FNV-1a of the command text. Async-signal-safe.
+uint32_t hash_command(const char *command) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)command; *c; c++)
+        h = (h ^ *c) * 16777619u;
+    return h;
+}
+
+//-------------------------------------------------------------
+// append_exit_record: Writes one exit record with a single O_APPEND write(), so records from
+// several shells sharing a log never interleave. Every EXITLOG_INDEX_STRIDE-th record (by its
+// position in the file) also gets an index entry. Only async-signal-safe calls are used.
+void append_exit_record(pid_t pid, int status, const struct rusage *usage, const struct job *job) {
+    if (exit_log.fd < 0)
+        return;
+    struct exit_record rec;
+    memset(&rec, 0, sizeof(rec));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.magic = EXITLOG_MAGIC;
+    rec.pid = pid;
+    rec.status = status;
+    rec.end_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    rec.start_ns = rec.end_ns;
+    if (job) {
+        // job->start/end are monotonic; carry the run time over to the realtime clock.
+        rec.start_ns = rec.end_ns - (int64_t)((job->end - job->start) * 1e9);
+        if (job->command) {
+            rec.command_hash = hash_command(job->command);
+            for (size_t i = 0; i < sizeof(rec.command) - 1 && job->command[i]; i++)
+                rec.command[i] = job->command[i];
+        }
+        rec.timeout_ms = (int32_t)(job->timeout * 1000);
+        rec.timeout_signal = job->timeout_signal;
+    }
+    rec.utime_us = (int64_t)usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec;
+    rec.stime_us = (int64_t)usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec;
+    rec.maxrss_kb = usage->ru_maxrss;
+    rec.minflt = usage->ru_minflt;
+    rec.majflt = usage->ru_majflt;
+    rec.nvcsw = usage->ru_nvcsw;
+    rec.nivcsw = usage->ru_nivcsw;
+    if (write(exit_log.fd, &rec, sizeof(rec)) != sizeof(rec))
+        return;
+    // With O_APPEND the offset after the write is the end of our record.
+    off_t end = lseek(exit_log.fd, 0, SEEK_CUR);
+    if (end < 0 || exit_log.index_fd < 0)
+        return;
+    uint64_t record = end / sizeof(rec) - 1;
+    if (record % EXITLOG_INDEX_STRIDE == 0) {
+        struct exit_index_entry entry = { rec.end_ns, record };
+        write(exit_log.index_fd, &entry, sizeof(entry));
+    }
+}
+
+//-------------------------------------------------------------
+// parse_log_time: Parses epoch seconds ("1700000000") or a time relative to now ("-90s",
+// "-15m", "-2h", "-7d") into CLOCK_REALTIME nanoseconds. Returns 0, or -1 if malformed.
+int parse_log_time(const char *text, int64_t *ns) {
+    char *end;
+    if (text[0] == '-') {
+        long amount = strtol(text + 1, &end, 10);
+        long unit = *end == 's' ? 1 : *end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 0;
+        if (end == text + 1 || unit == 0 || end[1] != '\0')
+            return -1;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        *ns = ((int64_t)now.tv_sec - amount * unit) * 1000000000 + now.tv_nsec;
+        return 0;
+    }
+    long long seconds = strtoll(text, &end, 10);
+    if (end == text || *end != '\0')
+        return -1;
+    *ns = (int64_t)seconds * 1000000000;
+    return 0;
+}
+
+//-------------------------------------------------------------
+// builtin_logq: logq [-f file] [--since T] [--until T] [--status N|ok|failed|signaled|timeout]
+//                    [--cmd TEXT] [--limit N] [--agg]
+// Prints the exit records that match every filter (T as for parse_log_time; --cmd matches the
+// whole command text via its hash), or with --agg one line per command: runs, failures, mean
+// and max wall time and total CPU. --since starts the scan at the sparse-index entry just
+// before that time, so recent-window queries read only the tail of a large log. The log is
+// only nearly sorted (clock steps, several shells sharing it), so --until ends the scan once
+// a whole chunk of records lies more than EXITLOG_UNTIL_SLACK_NS past it.
+void builtin_logq(char **tokens, FILE *out) {
+    const char *path = exit_log.path ? exit_log.path : getenv("MYSHELL_EXITLOG");
+    int64_t since = INT64_MIN, until = INT64_MAX;
+    const char *status_filter = NULL;
+    const char *cmd = NULL;
+    long limit = -1;
+    int agg = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        const char *opt = tokens[i];
+        const char *arg = tokens[i + 1];
+        if (strcmp(opt, "--agg") == 0) {
+            agg = 1;
+            continue;
+        }
+        if (arg == NULL) {
+            fprintf(stderr, "usage: logq [-f file] [--since T] [--until T] [--status N|ok|failed|signaled|timeout]"
+                    " [--cmd TEXT] [--limit N] [--agg]\n");
+            return;
+        }
+        i++;
+        if (strcmp(opt, "-f") == 0)
+            path = arg;
+        else if (strcmp(opt, "--since") == 0 || strcmp(opt, "--until") == 0) {
+            if (parse_log_time(arg, strcmp(opt, "--since") == 0 ? &since : &until) != 0) {
+                fprintf(stderr, "logq: bad time: %s (use epoch seconds or -N[smhd])\n", arg);
+                return;
+            }
+        }
+        else if (strcmp(opt, "--status") == 0)
+            status_filter = arg;
+        else if (strcmp(opt, "--cmd") == 0)
+            cmd = arg;
+        else if (strcmp(opt, "--limit") == 0)
+            limit = atol(arg);
+        else {
+            fprintf(stderr, "logq: unknown option: %s\n", opt);
+            return;
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "logq: no exit log (set MYSHELL_EXITLOG before starting the shell, or use -f)\n");
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    uint32_t cmd_hash = cmd ? hash_command(cmd) : 0;
+
+    // Find the first record to read: the last index entry strictly before 'since'.
+    uint64_t first = 0;
+    if (since != INT64_MIN) {
+        char index_path[4096];
+        snprintf(index_path, sizeof(index_path), "%s.idx", path);
+        int index_fd = open(index_path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (index_fd >= 0 && fstat(index_fd, &st) == 0) {
+            size_t lo = 0, hi = st.st_size / sizeof(struct exit_index_entry);
+            struct exit_index_entry entry;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (pread(index_fd, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry))
+                    break;
+                if (entry.end_ns < since) {
+                    first = entry.record;
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+        }
+        if (index_fd >= 0)
+            close(index_fd);
+    }
+
+    // Per-command aggregates for --agg, in first-seen order.
+    struct command_stats {
+        uint32_t hash;
+        char command[sizeof(((struct exit_record *)0)->command)];
+        long runs, failures;
+        double wall_sum, wall_max, cpu;
+    } *groups = NULL;
+    size_t n_groups = 0, groups_cap = 0;
+
+    static struct exit_record chunk[512];
+    long scanned = 0, matched = 0;
+    int past_until = 0;  // Every record of the current chunk ended after stop_after
+    int64_t stop_after = until > INT64_MAX - EXITLOG_UNTIL_SLACK_NS ? INT64_MAX : until + EXITLOG_UNTIL_SLACK_NS;
+    off_t offset = (off_t)first * sizeof(struct exit_record);
+    ssize_t got;
+    if (!agg)
+        fprintf(out, "%-19s %8s %8s %10s %9s %9s %9s  %s\n",
+                "end", "pid", "status", "wall_s", "user_s", "sys_s", "rss_kb", "command");
+    while (!past_until && (limit < 0 || matched < limit) &&
+           (got = pread(fd, chunk, sizeof(chunk), offset)) > 0) {
+        size_t n = got / sizeof(struct exit_record);
+        if (n == 0)
+            break;  // Trailing partial record (a write in progress).
+        offset += n * sizeof(struct exit_record);
+        past_until = until != INT64_MAX;
+        for (size_t i = 0; i < n && (limit < 0 || matched < limit); i++) {
+            const struct exit_record *rec = &chunk[i];
+            scanned++;
+            if (rec->magic != EXITLOG_MAGIC || rec->end_ns <= stop_after)
+                past_until = 0;
+            if (rec->magic != EXITLOG_MAGIC || rec->end_ns < since || rec->end_ns > until)
+                continue;
+            if (cmd && rec->command_hash != cmd_hash)
+                continue;
+            if (status_filter) {
+                int ok = WIFEXITED(rec->status) && WEXITSTATUS(rec->status) == 0;
+                if (strcmp(status_filter, "timeout") == 0 ? rec->timeout_signal == 0 :
+                    strcmp(status_filter, "ok") == 0 ? !ok :
+                    strcmp(status_filter, "failed") == 0 ? ok :
+                    strcmp(status_filter, "signaled") == 0 ? !WIFSIGNALED(rec->status) :
+                    !(WIFEXITED(rec->status) && WEXITSTATUS(rec->status) == atoi(status_filter)))
+                    continue;
+            }
+            matched++;
+            double wall = (rec->end_ns - rec->start_ns) / 1e9;
+            double cpu = (rec->utime_us + rec->stime_us) / 1e6;
+            if (!agg) {
+                char when[32];
+                time_t t = rec->end_ns / 1000000000;
+                struct tm tm;
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+                char status[16];
+                const char *timed_out = rec->timeout_signal ? "T:" : "";  // Deadline passed
+                if (WIFSIGNALED(rec->status))
+                    snprintf(status, sizeof(status), "%ssig%d", timed_out, WTERMSIG(rec->status));
+                else
+                    snprintf(status, sizeof(status), "%s%d", timed_out, WEXITSTATUS(rec->status));
+                fprintf(out, "%-19s %8d %8s %10.3f %9.3f %9.3f %9lld  %.*s\n", when, rec->pid, status,
+                        wall, rec->utime_us / 1e6, rec->stime_us / 1e6, (long long)rec->maxrss_kb,
+                        (int)sizeof(rec->command), rec->command);
+                continue;
+            }
+            struct command_stats *g = NULL;
+            for (size_t k = 0; k < n_groups && !g; k++)
+                if (groups[k].hash == rec->command_hash)
+                    g = &groups[k];
+            if (g == NULL) {
+                if (n_groups == groups_cap) {
+                    groups_cap = groups_cap ? groups_cap * 2 : 16;
+                    groups = realloc(groups, groups_cap * sizeof(*groups));
+                    if (!groups) {
+                        perror("realloc");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                g = &groups[n_groups++];
+                memset(g, 0, sizeof(*g));
+                g->hash = rec->command_hash;
+                memcpy(g->command, rec->command, sizeof(g->command));
+            }
+            g->runs++;
+            g->failures += !(WIFEXITED(rec->status) && WEXITSTATUS(rec->status) == 0);
+            g->wall_sum += wall;
+            if (wall > g->wall_max)
+                g->wall_max = wall;
+            g->cpu += cpu;
+        }
+    }
+    close(fd);
+    if (agg) {
+        fprintf(out, "%8s %8s %10s %10s %10s  %s\n", "runs", "failed", "mean_s", "max_s", "cpu_s", "command");
+        for (size_t k = 0; k < n_groups; k++)
+            fprintf(out, "%8ld %8ld %10.3f %10.3f %10.3f  %.*s\n", groups[k].runs, groups[k].failures,
+                    groups[k].wall_sum / groups[k].runs, groups[k].wall_max, groups[k].cpu,
+                    (int)sizeof(groups[k].command), groups[k].command);
+        free(groups);
+    }
+    fprintf(out, "%ld matched, %ld scanned (from record %llu)\n", matched, scanned, (unsigned long long)first);
+}
+
+//-------------------------------------------------------------
+// count_allocation: Records one successful allocation of request bytes at ptr. The block
+// joins live only if it can be tracked, so its free is matched later.
+void count_allocation(void *ptr, size_t request) {
+    if (!ptr)
+        return;
+    memstat.allocs++;
+    memstat.bytes += request;
+    if (track_block(ptr) != 0)
+        return;
+    memstat.live += malloc_usable_size(ptr);
+    if (memstat.live > memstat.peak)
+        memstat.peak = memstat.live;
+}
+
+//-------------------------------------------------------------
+// block_slot: Home slot of ptr in memstat_blocks (cap must be non-zero).
+size_t block_slot(const void *ptr) {
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 7) & (memstat_blocks.cap - 1);
+}
+
+//-------------------------------------------------------------
+// track_block: Adds ptr to memstat_blocks, doubling the table (kept at most half full)
+// first if needed. Returns 0, or -1 if the table cannot grow.
+int track_block(void *ptr) {
+    if ((memstat_blocks.count + 1) * 2 > memstat_blocks.cap) {
+        size_t cap = memstat_blocks.cap ? memstat_blocks.cap * 2 : 4096;
+        void **slots = mmap(NULL, cap * sizeof(void *), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slots == MAP_FAILED)
+            return -1;
+        void **old = memstat_blocks.slots;
+        size_t old_cap = memstat_blocks.cap;
+        memstat_blocks.slots = slots;
+        memstat_blocks.cap = cap;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i] == NULL)
+                continue;
+            size_t j = block_slot(old[i]);
+            while (slots[j] != NULL)
+                j = (j + 1) & (cap - 1);
+            slots[j] = old[i];
+        }
+        if (old)
+            munmap(old, old_cap * sizeof(void *));
+    }
+    size_t i = block_slot(ptr);
+    while (memstat_blocks.slots[i] != NULL && memstat_blocks.slots[i] != ptr)
+        i = (i + 1) & (memstat_blocks.cap - 1);
+    if (memstat_blocks.slots[i] == NULL)
+        memstat_blocks.count++;
+    memstat_blocks.slots[i] = ptr;
+    return 0;
+}
+
+//-------------------------------------------------------------
+// untrack_block: Removes ptr from memstat_blocks, shifting later entries of its probe run
+// back so lookups need no tombstones. Returns 1 if ptr was tracked, else 0.
+int untrack_block(void *ptr) {
+    if (memstat_blocks.count == 0)
+        return 0;
+    size_t mask = memstat_blocks.cap - 1;
+    void **slots = memstat_blocks.slots;
+    size_t i = block_slot(ptr);
+    while (slots[i] != ptr) {
+        if (slots[i] == NULL)
+            return 0;
+        i = (i + 1) & mask;
+    }
+    // Backward-shift deletion: move up any entry whose home slot is not between the hole and it.
+    for (size_t j = (i + 1) & mask; slots[j] != NULL; j = (j + 1) & mask) {
+        size_t home = block_slot(slots[j]);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i] = NULL;
+    memstat_blocks.count--;
+    return 1;
+}
+
+//-------------------------------------------------------------
+// clear_tracked_blocks: Forgets every tracked block, as live restarts from 0.
+void clear_tracked_blocks(void) {
+    if (memstat_blocks.slots)
+        memset(memstat_blocks.slots, 0, memstat_blocks.cap * sizeof(void *));
+    memstat_blocks.count = 0;
+}
+
+//-------------------------------------------------------------
+// memstat_begin_line: Starts measuring a command line: remembers the totals and restarts the
+// high-water mark from the current live heap.
+void memstat_begin_line(void) {
+    memstat.in_line = memstat.enabled;
+    if (!memstat.enabled)
+        return;
+    memstat.line_allocs = memstat.allocs;
+    memstat.line_bytes = memstat.bytes;
+    memstat.line_live = memstat.live;
+    memstat.peak = memstat.live;
+}
+
+//-------------------------------------------------------------
+// memstat_end_line: Finishes measuring a command line, folds it into the worst-case numbers
+// and reports it on stderr together with the shell's RSS.
+void memstat_end_line(const char *line) {
+    if (!memstat.enabled || !memstat.in_line)
+        return;  // Off, or switched on during this line.
+    memstat.in_line = 0;
+    struct line_memstat *l = &memstat.last;
+    l->allocs = memstat.allocs - memstat.line_allocs;
+    l->bytes = memstat.bytes - memstat.line_bytes;
+    l->peak = memstat.peak - memstat.line_live;
+    l->net = memstat.live - memstat.line_live;
+    l->rss_kb = read_rss_kb();
+    memstat.lines++;
+    struct line_memstat *w = &memstat.worst;
+    if (l->allocs > w->allocs)
+        w->allocs = l->allocs;
+    if (l->bytes > w->bytes)
+        w->bytes = l->bytes;
+    if (l->peak > w->peak)
+        w->peak = l->peak;
+    if (l->net > w->net)
+        w->net = l->net;
+    if (l->rss_kb > w->rss_kb)
+        w->rss_kb = l->rss_kb;
+    fprintf(stderr, "memstat: allocs=%llu bytes=%llu peak=%lld net=%+lld rss=%ldkB  %s\n",
+            (unsigned long long)l->allocs, (unsigned long long)l->bytes, (long long)l->peak,
+            (long long)l->net, l->rss_kb, line);
+}
+
+//-------------------------------------------------------------
+// read_rss_kb: Returns the shell's resident set size in kB, or -1 if /proc is unavailable.
+long read_rss_kb(void) {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    long size, resident;
+    if (sscanf(buf, "%ld %ld", &size, &resident) != 2)
+        return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+//-------------------------------------------------------------
+// builtin_memstat: memstat
+// Prints the shell's RSS (now and peak), glibc's arena totals and, once "set memstat=on" has
+// been used, the heap accounting: totals, live heap, and per-line numbers for the last line
+// and the worst line so far. A "net" that stays positive line after line is a leak.
+void builtin_memstat(FILE *out) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    struct mallinfo2 mi = mallinfo2();
+    fprintf(out, "rss %ldkB (peak %ldkB)  arena %zukB  in use %zukB  free %zukB  mmap %zukB\n",
+            read_rss_kb(), usage.ru_maxrss, (mi.arena + mi.hblkhd) / 1024, (mi.uordblks + mi.hblkhd) / 1024,
+            mi.fordblks / 1024, mi.hblkhd / 1024);
+    if (!memstat.enabled) {
+        fprintf(out, "heap accounting is off (set memstat=on)\n");
+        return;
+    }
+    fprintf(out, "since enabled: %ld lines, %llu allocs, %llu frees, %llu bytes, live %+lld bytes\n",
+            memstat.lines, (unsigned long long)memstat.allocs, (unsigned long long)memstat.frees,
+            (unsigned long long)memstat.bytes, (long long)memstat.live);
+    fprintf(out, "%-6s %10s %12s %12s %12s %10s\n", "line", "allocs", "bytes", "peak", "net", "rss_kB");
+    const struct line_memstat *rows[] = { &memstat.last, &memstat.worst };
+    const char *names[] = { "last", "worst" };
+    for (int i = 0; i < 2; i++)
+        fprintf(out, "%-6s %10llu %12llu %12lld %+12lld %10ld\n", names[i],
+                (unsigned long long)rows[i]->allocs, (unsigned long long)rows[i]->bytes,
+                (long long)rows[i]->peak, (long long)rows[i]->net, rows[i]->rss_kb);
+}
+
+//-------------------------------------------------------------
+// builtin_limit: limit [mem=SIZE] [cpu=N%] [pids=N] -- command...
+// Runs the command (foreground, or '&') in a transient cgroup v2 child of cgroup_base().
+// The child is created directly in it with clone3(CLONE_INTO_CGROUP), so no instruction of
+// the command ever runs unlimited. SIZE takes a K/M/G/T suffix; cpu=200% allows two CPUs'
+// worth of time per period. When the job is released its memory.peak and cpu.stat are
+// reported on stderr and the cgroup is removed.
+void builtin_limit(char **tokens, FILE *out, struct launch_attrs *attrs) {
+    (void)out;
+    char mem[32] = "", cpu[32] = "", pids[32] = "";
+    int k = 1;
+    for (; tokens[k] != NULL && strcmp(tokens[k], "--") != 0; k++) {
+        char *value = strchr(tokens[k], '=');
+        char *end;
+        if (value == NULL)
+            break;
+        value++;
+        if (strncmp(tokens[k], "mem=", 4) == 0) {
+            double n = strtod(value, &end);
+            const char *units = "KMGT";
+            const char *unit = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+            if (end == value || n <= 0 || (*end && (unit == NULL || end[1] != '\0'))) {
+                fprintf(stderr, "limit: mem must be a size like 512M or 2G\n");
+                return;
+            }
+            for (const char *u = units; unit && u <= unit; u++)
+                n *= 1024;
+            snprintf(mem, sizeof(mem), "%.0f", n);
+        } else if (strncmp(tokens[k], "cpu=", 4) == 0) {
+            long percent = strtol(value, &end, 10);
+            if (end == value || percent <= 0 || (*end != '\0' && strcmp(end, "%") != 0)) {
+                fprintf(stderr, "limit: cpu must be a percentage like 50%% or 200%%\n");
+                return;
+            }
+            snprintf(cpu, sizeof(cpu), "%ld %d", percent * CPU_MAX_PERIOD / 100, CPU_MAX_PERIOD);
+        } else if (strncmp(tokens[k], "pids=", 5) == 0) {
+            long n = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || n <= 0) {
+                fprintf(stderr, "limit: pids must be a positive number\n");
+                return;
+            }
+            snprintf(pids, sizeof(pids), "%ld", n);
+        } else {
+            fprintf(stderr, "limit: unknown limit: %s\n", tokens[k]);
+            return;
+        }
+    }
+    if (tokens[k] != NULL && strcmp(tokens[k], "--") == 0)
+        k++;
+    char **cmd = tokens + k;
+    if (cmd[0] == NULL) {
+        fprintf(stderr, "usage: limit [mem=SIZE] [cpu=N%%] [pids=N] -- command [args...]\n");
+        return;
+    }
+    if (is_shell_builtin(cmd[0]) && !is_launch_prefix(cmd[0])) {
+        fprintf(stderr, "limit: %s is a builtin and runs inside the shell\n", cmd[0]);
+        return;
+    }
+    const char *base = cgroup_base();
+    if (base == NULL)
+        return;
+    char wanted[32] = "";
+    if (mem[0])
+        strcat(wanted, " memory");
+    if (cpu[0])
+        strcat(wanted, " cpu");
+    if (pids[0])
+        strcat(wanted, " pids");
+    if (enable_cgroup_controllers(base, wanted) != 0)
+        return;
+
+    // Create the job's cgroup and set its limits before anything runs in it.
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/myshell-%d-%ld", base, (int)getpid(), ++cgroups.created);
+    if (mkdir(path, 0755) != 0) {
+        perror(path);
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (mem[0] && write_cgroup_file(fd, "memory.max", mem) != 0) ||
+        (cpu[0] && write_cgroup_file(fd, "cpu.max", cpu) != 0) ||
+        (pids[0] && write_cgroup_file(fd, "pids.max", pids) != 0)) {
+        if (fd >= 0)
+            close(fd);
+        rmdir(path);
+        return;
+    }
+
+    struct launch_attrs none;
+    init_launch_attrs(&none);
+    if (attrs == NULL)
+        attrs = &none;
+    attrs->cgroup_fd = fd;
+    unsigned long spawned = metrics.spawned;
+    run_command(cmd, attrs);
+    // Queued '&' commands took the descriptor along; otherwise nothing started if no fork
+    // happened, and the empty cgroup is removed here instead of at release.
+    if (attrs->cgroup_fd >= 0 && metrics.spawned == spawned)
+        rmdir(path);
+    if (attrs == &none)
+        release_launch_attrs(&none);
+}
+
+//-------------------------------------------------------------
+// fork_into_cgroup: Like fork(), but the child starts life in the cgroup open as cgroup_fd
+// (clone3 with CLONE_INTO_CGROUP, Linux 5.7+). On older kernels, which lack clone3 (ENOSYS)
+// or reject the cgroup field of a struct larger than theirs (E2BIG), it falls back to fork()
+// and the child moves itself through cgroup.procs before returning. Other errors are real.
+pid_t fork_into_cgroup(int cgroup_fd) {
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = cgroup_fd;
+    pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid >= 0 || (errno != ENOSYS && errno != E2BIG))
+        return pid;
+    pid = fork();
+    if (pid == 0 && write_cgroup_file(cgroup_fd, "cgroup.procs", "0") != 0)
+        _exit(EXIT_FAILURE);
+    return pid;
+}
+
+//-------------------------------------------------------------
+// cgroup_base: Returns the directory job cgroups go under: $MYSHELL_CGROUP, or the shell's
+// own cgroup ("0::" line of /proc/self/cgroup) below the cgroup2 mount found in
+// /proc/self/mountinfo. Prints an error and returns NULL if there is no cgroup v2.
+const char *cgroup_base(void) {
+    if (cgroups.base)
+        return cgroups.base;
+    const char *env = getenv("MYSHELL_CGROUP");
+    if (env && *env) {
+        cgroups.base = strdup(env);
+        return cgroups.base;
+    }
+    char mount[4096] = "", own[4096] = "", line[8192];
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        // "id parent major:minor root mountpoint options... - fstype source superoptions"
+        char *sep = strstr(line, " - cgroup2 ");
+        if (sep && sscanf(line, "%*s %*s %*s %*s %4095s", mount) == 1)
+            break;
+        mount[0] = '\0';
+    }
+    if (f)
+        fclose(f);
+    f = fopen("/proc/self/cgroup", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(own, sizeof(own), "%.4000s", line + 3);
+        }
+    }
+    if (f)
+        fclose(f);
+    if (mount[0] == '\0' || own[0] == '\0') {
+        fprintf(stderr, "limit: no cgroup v2 hierarchy (set MYSHELL_CGROUP to a delegated directory)\n");
+        return NULL;
+    }
+    size_t len = strlen(mount) + strlen(own) + 1;
+    cgroups.base = malloc(len);
+    if (!cgroups.base) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(cgroups.base, len, "%s%s", mount, strcmp(own, "/") == 0 ? "" : own);
+    return cgroups.base;
+}
+
+//-------------------------------------------------------------
+// enable_cgroup_controllers: Makes the space-separated controllers in wanted available to
+// base's children. cgroup v2 forbids enabling controllers for children of a cgroup that has
+// processes of its own (except the root), so if the shell sits in base the user is asked for
+// a MYSHELL_CGROUP instead: a leaf the shell moved itself into could not be removed on exit.
+// Returns 0, or -1 after printing why the limit cannot apply.
+int enable_cgroup_controllers(const char *base, const char *wanted) {
+    char path[4096], available[512] = "", enabled[512] = "";
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", base);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (!fgets(available, sizeof(available), f))
+            available[0] = '\0';
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", base);
+    f = fopen(path, "r");
+    if (f) {
+        if (!fgets(enabled, sizeof(enabled), f))
+            enabled[0] = '\0';
+        fclose(f);
+    }
+    char list[32];
+    snprintf(list, sizeof(list), "%s", wanted);
+    for (char *name = strtok(list, " "); name; name = strtok(NULL, " ")) {
+        char padded[64];
+        snprintf(padded, sizeof(padded), " %s ", name);
+        char have[520];
+        snprintf(have, sizeof(have), " %.*s ", (int)strcspn(enabled, "\n"), enabled);
+        if (strstr(have, padded))
+            continue;  // Already enabled for children.
+        snprintf(have, sizeof(have), " %.*s ", (int)strcspn(available, "\n"), available);
+        if (!strstr(have, padded)) {
+            fprintf(stderr, "limit: the %s controller is not available in %s\n", name, base);
+            return -1;
+        }
+        int fd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        char control[64];
+        snprintf(control, sizeof(control), "+%s", name);
+        int rc = fd >= 0 ? write_cgroup_file(fd, "cgroup.subtree_control", control) : -1;
+        if (rc != 0 && errno == EBUSY)  // Processes (the shell among them) live in base itself.
+            fprintf(stderr, "limit: %s has processes of its own; set MYSHELL_CGROUP to an empty "
+                    "delegated cgroup\n", base);
+        if (fd >= 0)
+            close(fd);
+        if (rc != 0)
+            return -1;
+    }
+    return 0;
+}
+
+//-------------------------------------------------------------
+// write_cgroup_file: Writes value to the file name inside the cgroup directory dir_fd.
+// Returns 0, or -1 (with errno set) after printing an error.
+int write_cgroup_file(int dir_fd, const char *name, const char *value) {
+    int fd = openat(dir_fd, name, O_WRONLY | O_CLOEXEC);
+    ssize_t n = -1;
+    if (fd >= 0) {
+        n = write(fd, value, strlen(value));
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    if (n < 0) {
+        int saved = errno;
+        fprintf(stderr, "limit: cannot write %s to %s: %s\n", value, name, strerror(saved));
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+//-------------------------------------------------------------
+// finish_job_cgroup: Called when a "limit" job is released: prints the cgroup's memory.peak
+// and cpu.stat (usage, and throttling if cpu.max was set) on stderr, then removes the cgroup.
+// If processes the job left behind still live there, the cgroup is kept and reported, or with
+// cgkill on they are killed and remove_drained_cgroup() removes it once it is empty.
+void finish_job_cgroup(struct job *job) {
+    char buf[1024], path[4096], link[64];
+    long long peak = -1, usage = 0, user = 0, sys = 0, throttled = 0, periods = 0;
+    int fd = openat(job->cgroup_fd, "memory.peak", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        if (n > 0) {
+            buf[n] = '\0';
+            peak = atoll(buf);
+        }
+        close(fd);
+    }
+    fd = openat(job->cgroup_fd, "cpu.stat", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        buf[n > 0 ? n : 0] = '\0';
+        for (char *line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+            sscanf(line, "usage_usec %lld", &usage);
+            sscanf(line, "user_usec %lld", &user);
+            sscanf(line, "system_usec %lld", &sys);
+            sscanf(line, "nr_throttled %lld", &periods);
+            sscanf(line, "throttled_usec %lld", &throttled);
+        }
+    }
+    char peak_text[32] = "n/a";
+    if (peak >= 0)
+        snprintf(peak_text, sizeof(peak_text), "%.1fMB", peak / 1048576.0);
+    fprintf(stderr, "limit: [%d] %s: memory.peak=%s cpu=%.3fs (user %.3fs sys %.3fs) throttled=%.3fs in %lld periods\n",
+            job->id, job->command, peak_text, usage / 1e6, user / 1e6, sys / 1e6, throttled / 1e6, periods);
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", job->cgroup_fd);
+    ssize_t n = readlink(link, path, sizeof(path) - 1);
+    close(job->cgroup_fd);
+    job->cgroup_fd = -1;
+    if (n <= 0)
+        return;
+    path[n] = '\0';
+    if (rmdir(path) == 0 || errno != EBUSY)
+        return;
+    int dir_fd = job_control.cgroup_kill ? open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (dir_fd >= 0) {
+        int killed = write_cgroup_file(dir_fd, "cgroup.kill", "1") == 0;
+        // cgroup.kill is asynchronous: the event loop removes the cgroup once it empties.
+        int events_fd = killed ? openat(dir_fd, "cgroup.events", O_RDONLY | O_CLOEXEC) : -1;
+        close(dir_fd);
+        if (events_fd >= 0) {
+            char *copy = strdup(path);
+            if (!copy) {
+                perror("strdup");
+                exit(EXIT_FAILURE);
+            }
+            fprintf(stderr, "limit: [%d] killed processes left by the job\n", job->id);
+            if (add_event_source(events_fd, POLLPRI, remove_drained_cgroup, copy) == 0) {
+                remove_drained_cgroup(events_fd, 0, copy);  // It may be empty already.
+                return;
+            }
+            close(events_fd);
+            free(copy);
+        }
+    }
+    fprintf(stderr, "limit: [%d] processes left by the job keep %s alive\n", job->id, path);
+}
+
+//-------------------------------------------------------------
+// remove_drained_cgroup: Event handler for the cgroup.events file of a killed job's cgroup
+// (arg is its path). The kernel raises POLLPRI when "populated" changes; once it reads 0 the
+// cgroup is removed and the source dropped. Reading the file re-arms the notification.
+void remove_drained_cgroup(int fd, short revents, void *arg) {
+    (void)revents;
+    char *path = arg;
+    char buf[256];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n < 0)
+        return;
+    buf[n] = '\0';
+    if (strstr(buf, "populated 1"))
+        return;
+    if (rmdir(path) != 0 && errno != ENOENT)
+        fprintf(stderr, "limit: cannot remove %s: %s\n", path, strerror(errno));
+    remove_event_source(fd);
+    close(fd);
+    free(path);
+}
+
+//-------------------------------------------------------------
+// release_untracked_cgroup: Called when a "limit" child could not be added to the job table,
+// so finish_job_cgroup() will never run for it. The cgroup is handed to remove_drained_cgroup()
+// right away, which removes it as soon as the child (and anything it started) has exited.
+void release_untracked_cgroup(int cgroup_fd) {
+    char path[4096], link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", cgroup_fd);
+    ssize_t n = readlink(link, path, sizeof(path) - 1);
+    if (n <= 0)
+        return;
+    path[n] = '\0';
+    int events_fd = openat(cgroup_fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+    if (events_fd < 0) {
+        fprintf(stderr, "limit: cannot watch %s: %s\n", path, strerror(errno));
+        return;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    if (add_event_source(events_fd, POLLPRI, remove_drained_cgroup, copy) == 0) {
+        remove_drained_cgroup(events_fd, 0, copy);  // The child may be gone already.
+        return;
+    }
+    fprintf(stderr, "limit: processes of an untracked job keep %s alive\n", path);
+    close(events_fd);
+    free(copy);
+}
+
+//-------------------------------------------------------------
+// builtin_launch_prefix: Shell-native versions of taskset, nice and chrt, without their extra
+// exec: the setting is recorded in the launch attributes and applied in the forked child
+// just before it execs the command. Prefixes nest and compose with limit, time and '&':
+//   affinity 0-3,6 cmd...           CPUs the command may run on
+//   nice N cmd...                   add N to the niceness (negative needs privilege)
+//   sched batch|idle|other cmd...   scheduling policy
+//   sched fifo|rr[:PRIO] cmd...     real-time policy, priority 1-99 (default 1)
+//   numa N cmd...                   CPUs and preferred memory of NUMA node N
+// "numa" alone lists the nodes and how many jobs run on each.
+void builtin_launch_prefix(char **tokens, FILE *out, struct launch_attrs *attrs) {
+    const char *name = tokens[0];
+    if (strcmp(name, "numa") == 0 && tokens[1] == NULL) {
+        if (load_numa_topology() < 1)
+            fprintf(stderr, "numa: no NUMA topology in /sys/devices/system/node\n");
+        else
+            print_numa_nodes(out);
+        return;
+    }
+    if (tokens[1] == NULL || tokens[2] == NULL) {
+        fprintf(stderr, "usage: affinity CPULIST cmd... | nice N cmd... | sched POLICY[:PRIO] cmd... | numa NODE cmd...\n");
+        return;
+    }
+    struct launch_attrs none;
+    init_launch_attrs(&none);
+    struct launch_attrs *a = attrs ? attrs : &none;
+    const char *arg = tokens[1];
+    char *end;
+    if (strcmp(name, "affinity") == 0) {
+        if (parse_cpu_list(arg, &a->affinity) != 0) {
+            fprintf(stderr, "affinity: bad CPU list: %s (use e.g. 0-3,6)\n", arg);
+            return;
+        }
+        a->has_affinity = 1;
+    } else if (strcmp(name, "nice") == 0) {
+        long n = strtol(arg, &end, 10);
+        if (end == arg || *end != '\0' || n < -40 || n > 40) {
+            fprintf(stderr, "nice: bad increment: %s\n", arg);
+            return;
+        }
+        a->nice += n;
+    } else if (strcmp(name, "numa") == 0) {
+        long id = strtol(arg, &end, 10);
+        int index = end == arg || *end != '\0' || load_numa_topology() < 1 ? -1 : find_numa_node(id);
+        if (index < 0) {
+            fprintf(stderr, "numa: no such node with CPUs: %s\n", arg);
+            return;
+        }
+        place_on_numa_node(a, index);
+    } else {
+        static const struct { const char *name; int policy; } policies[] = {
+            { "other", SCHED_OTHER }, { "batch", SCHED_BATCH }, { "idle", SCHED_IDLE },
+            { "fifo", SCHED_FIFO }, { "rr", SCHED_RR },
+        };
+        size_t len = strcspn(arg, ":");
+        int policy = -1;
+        for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+            if (strlen(policies[i].name) == len && strncmp(arg, policies[i].name, len) == 0)
+                policy = policies[i].policy;
+        long priority = 0;
+        if (policy == SCHED_FIFO || policy == SCHED_RR) {
+            priority = 1;
+            if (arg[len] == ':') {
+                priority = strtol(arg + len + 1, &end, 10);
+                if (end == arg + len + 1 || *end != '\0' || priority < 1 || priority > 99)
+                    policy = -1;
+            }
+        } else if (arg[len] != '\0') {
+            policy = -1;  // Only real-time policies take a priority.
+        }
+        if (policy < 0) {
+            fprintf(stderr, "sched: bad policy: %s (use other, batch, idle, fifo[:PRIO] or rr[:PRIO])\n", arg);
+            return;
+        }
+        a->policy = policy;
+        a->priority = priority;
+    }
+    char **cmd = tokens + 2;
+    if (is_shell_builtin(cmd[0]) && !is_launch_prefix(cmd[0]))
+        fprintf(stderr, "%s: %s is a builtin and runs inside the shell\n", name, cmd[0]);
+    else
+        run_command(cmd, a);
+    if (a == &none)
+        release_launch_attrs(&none);
+}
+
+//-------------------------------------------------------------
+// is_launch_prefix: Returns 1 for the builtins that launch the command that follows them,
+// so they can be chained after one another (e.g. "nice 5 limit mem=1G -- cmd &").
+int is_launch_prefix(const char *name) {
+    static const char *prefixes[] = { "affinity", "nice", "sched", "numa", "limit", "ulimit", "timeout", "supervise", "time", "pstat", NULL };
+    for (int i = 0; prefixes[i] != NULL; i++)
+        if (strcmp(name, prefixes[i]) == 0)
+            return 1;
+    return 0;
+}
+
+//-------------------------------------------------------------
+// parse_cpu_list: Parses a CPU list such as "0-3,6,8-9" into set.
+// Returns 0, or -1 if the list is malformed or names a CPU beyond CPU_SETSIZE.
+int parse_cpu_list(const char *text, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = text;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*end == ',' && end[1] != '\0')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+//-------------------------------------------------------------
+// builtin_ulimit: ulimit [-a] | ulimit [-S|-H] [-n|-v|-t|-c|-u [VALUE]]... [-- cmd...]
+// Without a command, shows or changes the shell's own limits with prlimit(), which every
+// later child inherits. With "-- cmd" the new limits apply to that command only: they are
+// set with prlimit() in the forked child before exec, so no wrapper process is needed.
+// VALUE is a number or "unlimited"; -S or -H changes only the soft or hard limit (default
+// both). Units: -n files, -v and -c kB, -t CPU seconds, -u processes.
+void builtin_ulimit(char **tokens, FILE *out, struct launch_attrs *attrs) {
+    static const struct { char flag; int resource; const char *name; rlim_t unit; } limits[] = {
+        { 'n', RLIMIT_NOFILE, "open files", 1 },
+        { 'v', RLIMIT_AS, "address space (kB)", 1024 },
+        { 't', RLIMIT_CPU, "cpu time (s)", 1 },
+        { 'c', RLIMIT_CORE, "core file size (kB)", 1024 },
+        { 'u', RLIMIT_NPROC, "processes", 1 },
+    };
+    const int n_limits = sizeof(limits) / sizeof(limits[0]);
+    int soft = 1, hard = 1;  // Which halves a new value replaces
+    int show_all = tokens[1] == NULL;
+    struct launch_attrs changes;
+    init_launch_attrs(&changes);
+    int k = 1;
+    for (; tokens[k] != NULL && strcmp(tokens[k], "--") != 0; k++) {
+        const char *opt = tokens[k];
+        if (strcmp(opt, "-a") == 0) {
+            show_all = 1;
+            continue;
+        }
+        if (strcmp(opt, "-S") == 0 || strcmp(opt, "-H") == 0) {
+            soft = opt[1] == 'S';
+            hard = opt[1] == 'H';
+            continue;
+        }
+        int which = -1;
+        for (int i = 0; i < n_limits && opt[0] == '-' && opt[1] != '\0' && opt[2] == '\0'; i++)
+            if (opt[1] == limits[i].flag)
+                which = i;
+        if (which < 0) {
+            fprintf(stderr, "ulimit: unknown option: %s (use -a, -S, -H, -n, -v, -t, -c or -u)\n", opt);
+            return;
+        }
+        struct rlimit current;
+        getrlimit(limits[which].resource, &current);
+        const char *value = tokens[k + 1];
+        if (value == NULL || value[0] == '-') {
+            // No value: show this limit.
+            rlim_t shown = hard && !soft ? current.rlim_max : current.rlim_cur;
+            if (shown == RLIM_INFINITY)
+                fprintf(out, "unlimited\n");
+            else
+                fprintf(out, "%llu\n", (unsigned long long)(shown / limits[which].unit));
+            continue;
+        }
+        k++;
+        rlim_t n = RLIM_INFINITY;
+        if (strcmp(value, "unlimited") != 0) {
+            char *end;
+            errno = 0;
+            unsigned long long v = strtoull(value, &end, 10);
+            if (end == value || *end != '\0' || value[0] == '-') {
+                fprintf(stderr, "ulimit: bad value: %s\n", value);
+                return;
+            }
+            // Values that would wrap (or land on RLIM_INFINITY) when scaled are refused.
+            if (errno == ERANGE || v > (RLIM_INFINITY - 1) / limits[which].unit) {
+                fprintf(stderr, "ulimit: value too large: %s (use unlimited)\n", value);
+                return;
+            }
+            n = v * limits[which].unit;
+        }
+        if (changes.n_rlimits == MAX_RLIMITS) {
+            fprintf(stderr, "ulimit: too many limits\n");
+            return;
+        }
+        struct rlimit *lim = &changes.rlimits[changes.n_rlimits].limit;
+        changes.rlimits[changes.n_rlimits++].resource = limits[which].resource;
+        *lim = current;
+        if (soft)
+            lim->rlim_cur = n;
+        if (hard)
+            lim->rlim_max = n;
+    }
+
+    if (tokens[k] != NULL) {
+        // ulimit ... -- cmd: the limits belong to the command.
+        char **cmd = tokens + k + 1;
+        if (cmd[0] == NULL || (is_shell_builtin(cmd[0]) && !is_launch_prefix(cmd[0]))) {
+            fprintf(stderr, cmd[0] ? "ulimit: %s is a builtin and runs inside the shell\n"
+                                   : "usage: ulimit [-S|-H] [-n|-v|-t|-c|-u VALUE]... -- command [args...]\n",
+                    cmd[0]);
+            return;
+        }
+        struct launch_attrs none;
+        init_launch_attrs(&none);
+        struct launch_attrs *a = attrs ? attrs : &none;
+        if (a->n_rlimits + changes.n_rlimits > MAX_RLIMITS) {
+            fprintf(stderr, "ulimit: too many limits (at most %d per command)\n", MAX_RLIMITS);
+            return;
+        }
+        for (int i = 0; i < changes.n_rlimits; i++)
+            a->rlimits[a->n_rlimits++] = changes.rlimits[i];
+        run_command(cmd, a);
+        if (a == &none)
+            release_launch_attrs(&none);
+        return;
+    }
+    for (int i = 0; i < changes.n_rlimits; i++)
+        if (prlimit(0, changes.rlimits[i].resource, &changes.rlimits[i].limit, NULL) != 0)
+            perror("ulimit");
+    if (!show_all)
+        return;
+    fprintf(out, "%-24s %14s %14s\n", "limit", "soft", "hard");
+    for (int i = 0; i < n_limits; i++) {
+        struct rlimit current;
+        getrlimit(limits[i].resource, &current);
+        char text[2][32];
+        rlim_t values[2] = { current.rlim_cur, current.rlim_max };
+        for (int j = 0; j < 2; j++) {
+            if (values[j] == RLIM_INFINITY)
+                snprintf(text[j], sizeof(text[j]), "unlimited");
+            else
+                snprintf(text[j], sizeof(text[j]), "%llu", (unsigned long long)(values[j] / limits[i].unit));
+        }
+        fprintf(out, "-%c %-21s %14s %14s\n", limits[i].flag, limits[i].name, text[0], text[1]);
+    }
+}
+
+//-------------------------------------------------------------
+// load_numa_topology: Reads the online NUMA nodes and their CPU lists from sysfs, once.
+// Memory-only nodes (no CPUs) are skipped: a job cannot be placed on them.
+// Returns the number of nodes with CPUs, or -1 if the topology is unavailable.
+int load_numa_topology(void) {
+    if (numa.loaded)
+        return numa.n_nodes > 0 ? numa.n_nodes : -1;
+    numa.loaded = 1;
+    cpu_set_t online;
+    if (read_cpu_list_file("/sys/devices/system/node/online", &online) != 0)
+        return -1;
+    for (int id = 0; id < MAX_NUMA_NODES; id++) {
+        if (!CPU_ISSET(id, &online))
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        struct numa_node *node = &numa.nodes[numa.n_nodes];
+        if (read_cpu_list_file(path, &node->cpus) != 0)
+            continue;
+        node->id = id;
+        numa.n_nodes++;
+    }
+    return numa.n_nodes > 0 ? numa.n_nodes : -1;
+}
+
+//-------------------------------------------------------------
+// read_cpu_list_file: Parses a sysfs list file such as node/online or nodeN/cpulist
+// ("0-3,8-11\n") into set. Returns 0, or -1 if it is missing, empty or malformed.
+int read_cpu_list_file(const char *path, cpu_set_t *set) {
+    char text[4096];
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    int ok = fgets(text, sizeof(text), f) != NULL;
+    fclose(f);
+    if (!ok)
+        return -1;
+    text[strcspn(text, "\n")] = '\0';
+    return parse_cpu_list(text, set);
+}
+
+//-------------------------------------------------------------
+// pick_numa_node: Returns the index (in numa.nodes) of the node the next '&' job goes to:
+// the next one in turn (rr), or the one with the fewest running jobs (least, ties to the
+// lowest node). Returns -1 if there is no topology.
+int pick_numa_node(void) {
+    if (load_numa_topology() < 1)
+        return -1;
+    if (numa.policy == NUMA_ROUND_ROBIN)
+        return numa.next++ % numa.n_nodes;
+    int best = 0, best_jobs = count_numa_jobs(numa.nodes[0].id);
+    for (int n = 1; n < numa.n_nodes; n++) {
+        int jobs = count_numa_jobs(numa.nodes[n].id);
+        if (jobs < best_jobs) {
+            best = n;
+            best_jobs = jobs;
+        }
+    }
+    return best;
+}
+
+//-------------------------------------------------------------
+// find_numa_node: Returns the index in numa.nodes of the node with the given ID, or -1.
+int find_numa_node(int id) {
+    for (int n = 0; n < numa.n_nodes; n++)
+        if (numa.nodes[n].id == id)
+            return n;
+    return -1;
+}
+
+//-------------------------------------------------------------
+// count_numa_jobs: Returns how many running jobs were placed on the node with the given ID.
+int count_numa_jobs(int node) {
+    int n = 0;
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (job_table[i].state == JOB_RUNNING && job_table[i].numa_node == node)
+            n++;
+    return n;
+}
+
+//-------------------------------------------------------------
+// place_on_numa_node: Makes a launch run on the CPUs of numa.nodes[index] and prefer its memory.
+void place_on_numa_node(struct launch_attrs *attrs, int index) {
+    attrs->numa_node = numa.nodes[index].id;
+    attrs->affinity = numa.nodes[index].cpus;
+    attrs->has_affinity = 1;
+}
+
+//-------------------------------------------------------------
+// print_numa_nodes: One line per NUMA node: its CPUs and how many running jobs it holds.
+void print_numa_nodes(FILE *out) {
+    static const char *policies[] = { "off", "rr", "least" };
+    fprintf(out, "node  jobs  cpus  (numa=%s)\n", policies[numa.policy]);
+    for (int n = 0; n < numa.n_nodes; n++) {
+        fprintf(out, "%4d  %4d  ", numa.nodes[n].id, count_numa_jobs(numa.nodes[n].id));
+        // Print the CPU set back as a list of ranges.
+        const char *sep = "";
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &numa.nodes[n].cpus))
+                continue;
+            int last = cpu;
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &numa.nodes[n].cpus))
+                last++;
+            if (last > cpu)
+                fprintf(out, "%s%d-%d", sep, cpu, last);
+            else
+                fprintf(out, "%s%d", sep, cpu);
+            sep = ",";
+            cpu = last;
+        }
+        fprintf(out, "\n");
+    }
+}
+
+//-------------------------------------------------------------
+// builtin_timeout: timeout [-k KILL_AFTER] DURATION [-k KILL_AFTER] command...
+// Runs the command (foreground or '&') with a deadline kept in the event loop: when it passes,
+// the shell sends SIGTERM and, with -k, SIGKILL after KILL_AFTER more: to the job's process group
+// under job control, otherwise through the job's pidfd (see signal_job).
+// Durations take an s/m/h/d suffix (default seconds). The deadline and whether it fired are
+// recorded in the binary exit log (logq shows such jobs as "T:..." and --status timeout).
+void builtin_timeout(char **tokens, FILE *out, struct launch_attrs *attrs) {
+    (void)out;
+    double duration = 0, kill_after = 0;
+    int k = 1;
+    while (tokens[k] != NULL) {
+        if (strcmp(tokens[k], "-k") == 0) {
+            if (tokens[k + 1] == NULL || parse_duration(tokens[k + 1], &kill_after) != 0 || kill_after <= 0) {
+                fprintf(stderr, "timeout: bad -k duration: %s\n", tokens[k + 1] ? tokens[k + 1] : "");
+                return;
+            }
+            k += 2;
+        } else if (duration == 0) {
+            if (parse_duration(tokens[k], &duration) != 0 || duration <= 0) {
+                fprintf(stderr, "timeout: bad duration: %s (use e.g. 30s, 1.5m, 2h)\n", tokens[k]);
+                return;
+            }
+            k++;
+        } else {
+            break;
+        }
+    }
+    char **cmd = tokens + k;
+    if (duration == 0 || cmd[0] == NULL) {
+        fprintf(stderr, "usage: timeout [-k KILL_AFTER] DURATION command [args...]\n");
+        return;
+    }
+    if (is_shell_builtin(cmd[0]) && !is_launch_prefix(cmd[0])) {
+        fprintf(stderr, "timeout: %s is a builtin and runs inside the shell\n", cmd[0]);
+        return;
+    }
+    struct launch_attrs none;
+    init_launch_attrs(&none);
+    struct launch_attrs *a = attrs ? attrs : &none;
+    a->timeout = duration;
+    a->kill_after = kill_after;
+    run_command(cmd, a);
+    if (a == &none)
+        release_launch_attrs(&none);
+}
+
+//-------------------------------------------------------------
+// parse_duration: Parses a non-negative duration such as "30", "30s", "1.5m", "2h" or "1d".
+// Returns 0, or -1 if text is malformed.
+int parse_duration(const char *text, double *seconds) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0)
+        return -1;
+    double unit = *end == '\0' || *end == 's' ? 1 : *end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 0;
+    if (unit == 0 || (*end != '\0' && end[1] != '\0'))
+        return -1;
+    *seconds = value * unit;
+    return 0;
+}
+
+//-------------------------------------------------------------
+// start_job_timeout: Gives a just-launched job its deadline. The pidfd is opened while the
+// child cannot have been reaped yet (SIGCHLD is blocked during launches), so later signals
+// reach this process even if its PID is reused. Called with SIGCHLD blocked.
+void start_job_timeout(struct job *job, double timeout, double kill_after) {
+    if (timeouts.fd < 0) {
+        timeouts.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timeouts.fd < 0 || add_event_source(timeouts.fd, POLLIN, expire_timeouts, NULL) != 0) {
+            fprintf(stderr, "timeout: cannot set up the timer: %s\n", strerror(errno));
+            if (timeouts.fd >= 0)
+                close(timeouts.fd);
+            timeouts.fd = -1;
+            return;
+        }
+    }
+    job->pid_fd = syscall(SYS_pidfd_open, job->pid, 0);
+    if (job->pid_fd < 0)
+        perror("pidfd_open");  // Still enforced, through kill() on the PID.
+    job->timeout = timeout;
+    job->kill_after = kill_after;
+    job->deadline = job->start + timeout;
+    arm_timeout_timer();
+}
+
+//-------------------------------------------------------------
+// arm_timeout_timer: Points the shared timerfd at the earliest deadline of a running job, or
+// disarms it if there is none.
+void arm_timeout_timer(void) {
+    if (timeouts.fd < 0)
+        return;
+    double next = 0;
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (job_table[i].state == JOB_RUNNING && job_table[i].deadline > 0 &&
+            (next == 0 || job_table[i].deadline < next))
+            next = job_table[i].deadline;
+    struct itimerspec when;
+    memset(&when, 0, sizeof(when));
+    if (next > 0) {
+        when.it_value.tv_sec = (time_t)next;
+        when.it_value.tv_nsec = (long)((next - (time_t)next) * 1e9);
+        if (when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0)
+            when.it_value.tv_nsec = 1;  // All zero would disarm the timer.
+    }
+    timerfd_settime(timeouts.fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+//-------------------------------------------------------------
+// expire_timeouts: Event handler for the timerfd. Every running job whose deadline has passed
+// gets SIGTERM (or, once -k has elapsed too, SIGKILL) through signal_job(), so helpers it
+// forked go too; then the timer is re-armed for the next deadline.
+void expire_timeouts(int fd, short revents, void *arg) {
+    (void)revents;
+    (void)arg;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN)
+        return;  // Re-armed for a later deadline since poll() reported it.
+    sigset_t old;
+    block_sigchld(&old);
+    double now = now_seconds();
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *job = &job_table[i];
+        if (job->state != JOB_RUNNING || job->deadline <= 0 || job->deadline > now)
+            continue;
+        int sig = job->timeout_signal == 0 ? SIGTERM : SIGKILL;
+        if (signal_job(job, sig) != 0 && errno != ESRCH)
+            perror("timeout");
+        job->timeout_signal = sig;
+        job->deadline = sig == SIGTERM && job->kill_after > 0 ? now + job->kill_after : 0;
+        fprintf(stderr, "timeout: [%d] %s: %s after %.1fs\n", job->id, job->command,
+                sig == SIGTERM ? "SIGTERM" : "SIGKILL", now - job->start);
+    }
+    arm_timeout_timer();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//-------------------------------------------------------------
+// psi_pressured: Returns 1 while any PSI monitor reports stall time above its threshold.
+int psi_pressured(void) {
+    return psi.monitors[0].pressured || psi.monitors[1].pressured;
+}
+
+//-------------------------------------------------------------
+// set_psi_threshold: Replaces m's trigger with one for percent% of PSI_WINDOW_US of "some"
+// stall, or removes it for 0. Returns 0, or -1 if the kernel has no PSI or refuses the trigger.
+int set_psi_threshold(struct psi_monitor *m, int percent) {
+    if (m->fd >= 0) {
+        remove_event_source(m->fd);
+        close(m->fd);
+        m->fd = -1;
+    }
+    m->percent = 0;
+    if (m->pressured) {
+        m->pressured = 0;
+        dispatch_job_queue();
+    }
+    if (percent == 0)
+        return 0;
+    char path[64], trigger[64];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", m->name);
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    int len = snprintf(trigger, sizeof(trigger), "some %llu %d",
+                       (unsigned long long)PSI_WINDOW_US * percent / 100, PSI_WINDOW_US);
+    if (fd < 0 || write(fd, trigger, len + 1) < 0 || add_event_source(fd, POLLPRI, on_psi_trigger, m) != 0) {
+        fprintf(stderr, "set: cannot watch %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    m->fd = fd;
+    m->percent = percent;
+    return 0;
+}
+
+//-------------------------------------------------------------
+// read_psi_total: Returns the "some" total= counter (microseconds stalled) of
+// /proc/pressure/<name>, or 0 if it cannot be read.
+unsigned long long read_psi_total(const char *name) {
+    char path[64], line[256];
+    unsigned long long total = 0;
+    snprintf(path, sizeof(path), "/proc/pressure/%s", name);
+    FILE *f = fopen(path, "r");
+    if (f && fgets(line, sizeof(line), f)) {
+        const char *p = strstr(line, "total=");
+        if (p)
+            total = strtoull(p + 6, NULL, 10);
+    }
+    if (f)
+        fclose(f);
+    return total;
+}
+
+//-------------------------------------------------------------
+// on_psi_trigger: Event handler for a PSI trigger. The kernel raised POLLPRI because stall time
+// in the last window passed the threshold: hold '&' jobs and start re-checking every window.
+// POLLERR means the monitored cgroup or file went away, so the monitor is switched off.
+void on_psi_trigger(int fd, short revents, void *arg) {
+    struct psi_monitor *m = arg;
+    (void)fd;
+    if (revents & (POLLERR | POLLNVAL)) {
+        fprintf(stderr, "[psi] %s trigger failed; no longer watching\n", m->name);
+        set_psi_threshold(m, 0);
+        return;
+    }
+    if (m->pressured)
+        return;
+    int was_pressured = psi_pressured();
+    m->pressured = 1;
+    m->last_total = read_psi_total(m->name);
+    if (was_pressured)
+        return;
+    psi.holds++;
+    fprintf(stderr, "[psi] %s pressure above %d%%: holding background jobs\n", m->name, m->percent);
+    if (psi.recheck_fd < 0) {
+        psi.recheck_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (psi.recheck_fd < 0 || add_event_source(psi.recheck_fd, POLLIN, recheck_psi, NULL) != 0) {
+            // Without re-checks the hold would never end.
+            perror("[psi] timerfd");
+            if (psi.recheck_fd >= 0)
+                close(psi.recheck_fd);
+            psi.recheck_fd = -1;
+            m->pressured = 0;
+            return;
+        }
+    }
+    struct itimerspec every = { { PSI_WINDOW_US / 1000000, PSI_WINDOW_US % 1000000 * 1000 },
+                                { PSI_WINDOW_US / 1000000, PSI_WINDOW_US % 1000000 * 1000 } };
+    timerfd_settime(psi.recheck_fd, 0, &every, NULL);
+    psi.recheck_at = now_seconds();
+}
+
+//-------------------------------------------------------------
+// recheck_psi: Event handler for the re-check timer. A monitor whose stall time over the last
+// interval fell below its threshold is cleared; once none is pressured the timer stops and
+// the queued '&' jobs are dispatched.
+void recheck_psi(int fd, short revents, void *arg) {
+    (void)revents;
+    (void)arg;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0)
+        return;
+    double now = now_seconds();
+    double elapsed_us = (now - psi.recheck_at) * 1e6;
+    psi.recheck_at = now;
+    for (int i = 0; i < 2; i++) {
+        struct psi_monitor *m = &psi.monitors[i];
+        if (!m->pressured)
+            continue;
+        unsigned long long total = read_psi_total(m->name);
+        double stalled = total > m->last_total ? (double)(total - m->last_total) : 0;
+        m->last_total = total;
+        if (elapsed_us > 0 && stalled * 100 < elapsed_us * m->percent)
+            m->pressured = 0;
+    }
+    if (psi_pressured())
+        return;
+    struct itimerspec off;
+    memset(&off, 0, sizeof(off));
+    timerfd_settime(psi.recheck_fd, 0, &off, NULL);
+    fprintf(stderr, "[psi] pressure eased: resuming background jobs\n");
+    dispatch_job_queue();
+}
+
+//-------------------------------------------------------------
+// setup_job_control: If stdin is a terminal and the shell's group owns it, foreground jobs
+// will be handed the terminal. SIGTTOU is ignored so the shell can take it back with
+// tcsetpgrp() from what is then a background group (children restore the default).
+void setup_job_control(void) {
+    if (!isatty(STDIN_FILENO) || tcgetpgrp(STDIN_FILENO) != getpgrp())
+        return;
+    signal(SIGTTOU, SIG_IGN);
+    job_control.terminal = 1;
+}
+
+//-------------------------------------------------------------
+// signal_job: Sends sig to every process in a running job's process group, so helpers it
+// forked go with it (without job control, to the job's process only); a stopped job also
+// gets SIGCONT so it can act on the signal. While the
+// leader is unreaped (SIGCHLD blocked, state JOB_RUNNING) its PID, and so the group ID,
+// cannot be reused. SIGKILL on a "limit" job also writes cgroup.kill, which reaches processes
+// that left the group. A job without a group of its own (no job control) is signalled
+// through its pidfd when it has one ("timeout"), so the signal cannot reach a reused PID.
+// Returns 0, or -1 with errno set.
+int signal_job(struct job *job, int sig) {
+    if (job->state != JOB_RUNNING) {
+        errno = ESRCH;
+        return -1;
+    }
+    int rc;
+    if (job->pgid > 0)
+        rc = kill(-job->pgid, sig);
+    else if (job->pid_fd >= 0)
+        rc = (int)syscall(SYS_pidfd_send_signal, job->pid_fd, sig, NULL, 0);
+    else
+        rc = kill(job->pid, sig);
+    if (rc == 0 && job->stopped && sig != SIGCONT && sig != SIGSTOP)
+        kill(job->pgid > 0 ? -job->pgid : job->pid, SIGCONT);
+    if (sig == SIGKILL && job->cgroup_fd >= 0)
+        write_cgroup_file(job->cgroup_fd, "cgroup.kill", "1");
+    return rc;
+}
+
+//-------------------------------------------------------------
+// builtin_kill: kill [-SIG | -s SIG] %JOB|PID...
+// %N signals job N's whole process group (see signal_job); a plain PID gets kill() as usual.
+// The default signal is SIGTERM. TERM, KILL or INT sent to a supervised job also ends its
+// supervision, so it is not restarted.
+void builtin_kill(char **tokens) {
+    int sig = SIGTERM;
+    int k = 1;
+    if (tokens[k] && strcmp(tokens[k], "-s") == 0 && tokens[k + 1]) {
+        sig = parse_signal(tokens[k + 1]);
+        k += 2;
+    } else if (tokens[k] && tokens[k][0] == '-') {
+        sig = parse_signal(tokens[k] + 1);
+        k++;
+    }
+    if (sig < 0) {
+        fprintf(stderr, "kill: unknown signal: %s\n", tokens[k - 1]);
+        return;
+    }
+    if (tokens[k] == NULL) {
+        fprintf(stderr, "usage: kill [-SIG | -s SIG] %%JOB|PID...\n");
+        return;
+    }
+    sigset_t old;
+    block_sigchld(&old);
+    for (; tokens[k] != NULL; k++) {
+        char *end;
+        const char *target = tokens[k][0] == '%' ? tokens[k] + 1 : tokens[k];
+        long n = strtol(target, &end, 10);
+        if (end == target || *end != '\0' || n <= 0) {
+            fprintf(stderr, "kill: bad job or PID: %s\n", tokens[k]);
+            continue;
+        }
+        int rc;
+        if (tokens[k][0] == '%') {
+            struct job *job = n <= MAX_JOBS ? &job_table[n - 1] : NULL;
+            if (job == NULL || job->state == JOB_FREE) {
+                fprintf(stderr, "kill: %s: no such job\n", tokens[k]);
+                continue;
+            }
+            if (job->supervisor && (sig == SIGTERM || sig == SIGKILL || sig == SIGINT))
+                supervision.entries[job->supervisor - 1].stopping = 1;  // Killed on purpose: no restart.
+            rc = signal_job(job, sig);
+        } else {
+            rc = kill((pid_t)n, sig);
+        }
+        if (rc != 0)
+            fprintf(stderr, "kill: %s: %s\n", tokens[k], strerror(errno));
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//-------------------------------------------------------------
+// parse_signal: Returns the number of a signal given as "TERM", "SIGTERM" or "15", or -1.
+int parse_signal(const char *name) {
+    static const struct { const char *name; int sig; } signals[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+        { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+    };
+    char *end;
+    long n = strtol(name, &end, 10);
+    if (end != name && *end == '\0')
+        return n >= 0 && n < NSIG ? (int)n : -1;
+    if (strncmp(name, "SIG", 3) == 0)
+        name += 3;
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        if (strcmp(name, signals[i].name) == 0)
+            return signals[i].sig;
+    return -1;
+}
+
+//-------------------------------------------------------------
+// set_adaptive_jobs: Turns the AIMD maxjobs controller on (starting from one job per online
+// CPU) or off (maxjobs keeps its current value). Returns 0, or -1 if the timer cannot be set.
+int set_adaptive_jobs(int enable) {
+    if (!enable || loadctl.enabled) {
+        if (!enable && loadctl.enabled) {
+            remove_event_source(loadctl.fd);
+            close(loadctl.fd);
+            loadctl.fd = -1;
+            loadctl.enabled = 0;
+        }
+        return 0;
+    }
+    loadctl.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loadctl.fd < 0 || add_event_source(loadctl.fd, POLLIN, sample_load, NULL) != 0) {
+        fprintf(stderr, "set: cannot start the load controller: %s\n", strerror(errno));
+        if (loadctl.fd >= 0)
+            close(loadctl.fd);
+        loadctl.fd = -1;
+        return -1;
+    }
+    struct itimerspec every = { { 0, LOADCTL_INTERVAL_MS * 1000000L }, { 0, LOADCTL_INTERVAL_MS * 1000000L } };
+    timerfd_settime(loadctl.fd, 0, &every, NULL);
+    loadctl.cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (loadctl.cpus < 1)
+        loadctl.cpus = 1;
+    read_load(&loadctl.runnable, &loadctl.loadavg);
+    loadctl.last_decrease = 0;
+    loadctl.enabled = 1;
+    job_queue.max_jobs = loadctl.cpus;
+    dispatch_job_queue();
+    return 0;
+}
+
+//-------------------------------------------------------------
+// read_load: Reads procs_running from /proc/stat (minus the shell, which is running while it
+// reads) and the 1-minute load average from /proc/loadavg. Returns 0, or -1 on failure.
+int read_load(double *runnable, double *loadavg) {
+    char line[256];
+    long running = -1;
+    FILE *f = fopen("/proc/stat", "r");
+    while (f && fgets(line, sizeof(line), f))
+        if (sscanf(line, "procs_running %ld", &running) == 1)
+            break;
+    if (f)
+        fclose(f);
+    f = fopen("/proc/loadavg", "r");
+    int ok = f && fscanf(f, "%lf", loadavg) == 1;
+    if (f)
+        fclose(f);
+    if (running < 0 || !ok)
+        return -1;
+    *runnable = running > 0 ? running - 1 : 0;
+    return 0;
+}
+
+//-------------------------------------------------------------
+// sample_load: Event handler for the controller's timer: one AIMD step. The runnable count
+// is smoothed (EWMA, alpha 1/2) against scheduler noise. Over target the limit halves, no more
+// than once a second; under target, and while jobs wait for a slot, it grows by one unless the
+// 1-minute load says the host has been saturated for a while. Changes are recorded for loadctl.
+void sample_load(int fd, short revents, void *arg) {
+    (void)revents;
+    (void)arg;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0)
+        return;
+    double runnable, loadavg;
+    if (read_load(&runnable, &loadavg) != 0)
+        return;
+    loadctl.samples++;
+    loadctl.runnable = (loadctl.runnable + runnable) / 2;
+    loadctl.loadavg = loadavg;
+    double target = loadctl.target * loadctl.cpus;
+    double now = now_seconds();
+    sigset_t old;
+    block_sigchld(&old);
+    int running = count_background_jobs();
+    int from = job_queue.max_jobs, to = from;
+    const char *reason = NULL;
+    if (loadctl.runnable > target && from > 1 && now - loadctl.last_decrease >= 1.0) {
+        to = from / 2;
+        loadctl.last_decrease = now;
+        loadctl.decreases++;
+        reason = "runnable over target";
+    } else if (loadctl.runnable < target && loadavg < target * 1.5 &&
+               job_queue.pending.depth > 0 && running >= from) {
+        to = from + 1;
+        loadctl.increases++;
+        reason = "queue waiting, runnable under target";
+    }
+    if (reason) {
+        struct loadctl_decision *d = &loadctl.history[loadctl.n_history++ % LOADCTL_HISTORY];
+        *d = (struct loadctl_decision){ now, loadctl.runnable, loadavg, running,
+                                        job_queue.pending.depth, from, to, reason };
+        job_queue.max_jobs = to;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (to > from)
+        dispatch_job_queue();
+}
+
+//-------------------------------------------------------------
+// builtin_loadctl: Shows the adaptive maxjobs controller: current limit, what it is aiming
+// for, the latest samples and its recent decisions (oldest first).
+void builtin_loadctl(FILE *out) {
+    if (!loadctl.enabled) {
+        fprintf(out, "loadctl: off (set maxjobs=auto to enable); maxjobs=%d\n", job_queue.max_jobs);
+        if (loadctl.n_history == 0)
+            return;
+    } else {
+        fprintf(out, "maxjobs=%d target=%.1f runnable (%.2f x %d CPUs) runnable=%.2f load1=%.2f\n",
+                job_queue.max_jobs, loadctl.target * loadctl.cpus, loadctl.target, loadctl.cpus,
+                loadctl.runnable, loadctl.loadavg);
+        fprintf(out, "running=%d queued=%d samples=%ld increases=%ld decreases=%ld\n",
+                count_background_jobs(), job_queue.pending.depth, loadctl.samples,
+                loadctl.increases, loadctl.decreases);
+    }
+    long first = loadctl.n_history > LOADCTL_HISTORY ? loadctl.n_history - LOADCTL_HISTORY : 0;
+    double now = now_seconds();
+    for (long i = first; i < loadctl.n_history; i++) {
+        const struct loadctl_decision *d = &loadctl.history[i % LOADCTL_HISTORY];
+        fprintf(out, "%8.1fs ago  maxjobs %d -> %d  runnable=%.2f load1=%.2f running=%d queued=%d  (%s)\n",
+                now - d->when, d->from, d->to, d->runnable, d->loadavg, d->running, d->queued, d->reason);
+    }
+}
+
+//-------------------------------------------------------------
+// builtin_supervise: supervise [--restart=on-failure|always] [--max=N] command [args...]
+//                    supervise --stop sN | supervise
+// Starts the command in the background and starts it again whenever it exits (with
+// on-failure, the default, only after a non-zero status or a signal). Restarts wait an
+// exponential backoff from SUPERVISE_BACKOFF_MIN up to SUPERVISE_BACKOFF_MAX, jittered to
+// 50-100% so several crashing helpers do not restart in lockstep; a run of SUPERVISE_HEALTHY
+// seconds resets it. SUPERVISE_CRASH_LOOP consecutive short runs, failed or not, are a crash
+// loop and supervision ends, as it does after --max restarts. Restarts are scheduled as soon as
+// the job is reaped, also while a foreground command runs, and fire from a timerfd, so nothing
+// polls or spins meanwhile. A "limit" cgroup lasts one run, so supervise refuses to run under it.
+// Without arguments, lists the supervised commands.
+void builtin_supervise(char **tokens, FILE *out, struct launch_attrs *attrs) {
+    int always = 0, max_restarts = 0, k = 1;
+    if (tokens[1] == NULL) {
+        double now = now_seconds();
+        for (int i = 0; i < MAX_SUPERVISORS; i++) {
+            struct supervisor *sup = &supervision.entries[i];
+            if (!sup->active)
+                continue;
+            char *command = join_tokens(sup->argv);
+            if (sup->pid > 0)
+                fprintf(out, "[s%d] running pid %d", i + 1, (int)sup->pid);
+            else
+                fprintf(out, "[s%d] restarting in %.1fs", i + 1, sup->next_start - now);
+            fprintf(out, "  restarts=%d", sup->restarts);
+            if (sup->max_restarts)
+                fprintf(out, "/%d", sup->max_restarts);
+            fprintf(out, "  %s%s\n", sup->always ? "(always)  " : "", command);
+            free(command);
+        }
+        return;
+    }
+    if (strcmp(tokens[1], "--stop") == 0) {
+        const char *id = tokens[2] ? tokens[2] + (tokens[2][0] == 's') : "";
+        int n = atoi(id);
+        if (n < 1 || n > MAX_SUPERVISORS || !supervision.entries[n - 1].active) {
+            fprintf(stderr, "supervise: no such supervised command: %s\n", tokens[2] ? tokens[2] : "");
+            return;
+        }
+        struct supervisor *sup = &supervision.entries[n - 1];
+        sigset_t old;
+        block_sigchld(&old);
+        sup->stopping = 1;
+        if (sup->pid > 0) {
+            struct job *job = find_job(sup->pid);
+            if (job)
+                signal_job(job, SIGTERM);  // Supervision ends when it is reaped.
+        } else {
+            end_supervision(sup, "stopped");
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return;
+    }
+    for (; tokens[k] != NULL && strncmp(tokens[k], "--", 2) == 0; k++) {
+        if (strcmp(tokens[k], "--restart=always") == 0)
+            always = 1;
+        else if (strcmp(tokens[k], "--restart=on-failure") == 0)
+            always = 0;
+        else if (strncmp(tokens[k], "--max=", 6) == 0 && atoi(tokens[k] + 6) > 0)
+            max_restarts = atoi(tokens[k] + 6);
+        else {
+            fprintf(stderr, "supervise: bad option: %s\n", tokens[k]);
+            return;
+        }
+    }
+    if (tokens[k] == NULL) {
+        fprintf(stderr, "usage: supervise [--restart=on-failure|always] [--max=N] command [args...]\n");
+        return;
+    }
+    if (is_shell_builtin(tokens[k])) {
+        fprintf(stderr, "supervise: %s is a builtin and runs inside the shell\n", tokens[k]);
+        return;
+    }
+    if (attrs && attrs->cgroup_fd >= 0) {
+        // The cgroup belongs to a single job; limit then removes it again, unused.
+        fprintf(stderr, "supervise: cannot run under limit (its cgroup holds one run only)\n");
+        return;
+    }
+    struct supervisor *sup = NULL;
+    for (int i = 0; i < MAX_SUPERVISORS && !sup; i++)
+        if (!supervision.entries[i].active)
+            sup = &supervision.entries[i];
+    if (sup == NULL) {
+        fprintf(stderr, "supervise: already supervising %d commands\n", MAX_SUPERVISORS);
+        return;
+    }
+    char **argv = process_tokens(tokens + k);
+    int n = 0;
+    while (argv[n] != NULL)
+        n++;
+    if (n > 0 && strcmp(argv[n - 1], "&") == 0) {
+        free(argv[--n]);  // Always runs in the background anyway.
+        argv[n] = NULL;
+    }
+    if (n == 0) {
+        free_tokens(argv);
+        return;
+    }
+    if (supervision.fd < 0) {
+        supervision.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (supervision.fd < 0 || add_event_source(supervision.fd, POLLIN, restart_due_supervised, NULL) != 0) {
+            fprintf(stderr, "supervise: cannot set up the restart timer: %s\n", strerror(errno));
+            if (supervision.fd >= 0)
+                close(supervision.fd);
+            supervision.fd = -1;
+            free_tokens(argv);
+            return;
+        }
+        srand48(getpid() ^ (long)(now_seconds() * 1e6));
+    }
+    memset(sup, 0, sizeof(*sup));
+    sup->active = 1;
+    sup->argv = argv;
+    sup->always = always;
+    sup->max_restarts = max_restarts;
+    // Keep the prefix settings (nice, affinity, ulimit, ...). Descriptors belong to one run.
+    init_launch_attrs(&sup->attrs);
+    if (attrs) {
+        sup->attrs = *attrs;
+        sup->attrs.stdin_fd = sup->attrs.stdout_fd = -1;
+        sup->attrs.n_pass_fds = 0;
+        sup->attrs.on_launch = NULL;
+    }
+    start_supervised(sup);
+}
+
+//-------------------------------------------------------------
+// start_supervised: Launches one run of a supervised command as a background job (bypassing
+// the maxjobs queue, since supervised helpers are long-lived) and tags the job with it.
+void start_supervised(struct supervisor *sup) {
+    sigset_t old;
+    block_sigchld(&old);
+    sup->next_start = 0;
+    sup->pid = launch_command(sup->argv, JOB_BACKGROUND, &sup->attrs);
+    struct job *job = sup->pid > 0 ? find_job(sup->pid) : NULL;
+    if (job) {
+        job->supervisor = sup - supervision.entries + 1;
+        job->restarts = sup->restarts;
+        fprintf(stderr, "[s%d] started pid %d (restart %d)\n", job->supervisor, (int)sup->pid, sup->restarts);
+    } else if (sup->pid > 0) {
+        fprintf(stderr, "supervise: job table full; pid %d is not supervised\n", (int)sup->pid);
+        end_supervision(sup, "could not track the job");
+    } else {
+        sup->pid = 0;
+        end_supervision(sup, "fork failed");
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//-------------------------------------------------------------
+// supervised_job_exited: Called by finish_background_job() (SIGCHLD blocked) for a finished job
+// that belongs to a supervisor: ends supervision or schedules the next start after the backoff.
+void supervised_job_exited(struct job *job) {
+    struct supervisor *sup = &supervision.entries[job->supervisor - 1];
+    sup->pid = 0;
+    int failed = !(WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0);
+    double ran = job->end - job->start;
+    if (sup->stopping) {
+        end_supervision(sup, "stopped");
+        return;
+    }
+    if (!failed && !sup->always) {
+        end_supervision(sup, "exited successfully");
+        return;
+    }
+    if (sup->max_restarts && sup->restarts >= sup->max_restarts) {
+        end_supervision(sup, "restart limit reached");
+        return;
+    }
+    // Short runs count whatever their status, so "--restart=always true" backs off too.
+    if (ran >= SUPERVISE_HEALTHY)
+        sup->short_runs = 0;
+    else if (++sup->short_runs >= SUPERVISE_CRASH_LOOP) {
+        fprintf(stderr, "[s%d] crash loop: %d runs ended within %.0fs each\n", job->supervisor,
+                sup->short_runs, SUPERVISE_HEALTHY);
+        end_supervision(sup, "crash loop");
+        return;
+    }
+    double delay = SUPERVISE_BACKOFF_MIN;
+    for (int i = 1; i < sup->short_runs && delay < SUPERVISE_BACKOFF_MAX; i++)
+        delay *= 2;
+    if (delay > SUPERVISE_BACKOFF_MAX)
+        delay = SUPERVISE_BACKOFF_MAX;
+    delay *= 0.5 + 0.5 * drand48();
+    sup->restarts++;
+    sup->next_start = now_seconds() + delay;
+    fprintf(stderr, "[s%d] %s exited (%s %d) after %.1fs; restart %d in %.1fs\n", job->supervisor,
+            job->command, WIFSIGNALED(job->status) ? "signal" : "status",
+            WIFSIGNALED(job->status) ? WTERMSIG(job->status) : WEXITSTATUS(job->status), ran,
+            sup->restarts, delay);
+    arm_supervision_timer();
+}
+
+//-------------------------------------------------------------
+// end_supervision: Reports why a supervised command will not be restarted and frees its entry.
+void end_supervision(struct supervisor *sup, const char *why) {
+    char *command = join_tokens(sup->argv);
+    fprintf(stderr, "[s%d] supervision ended: %s after %d restarts  %s\n",
+            (int)(sup - supervision.entries) + 1, why, sup->restarts, command);
+    free(command);
+    free_tokens(sup->argv);
+    sup->argv = NULL;
+    sup->active = 0;
+    arm_supervision_timer();
+}
+
+//-------------------------------------------------------------
+// arm_supervision_timer: Points the timerfd at the earliest pending restart, or disarms it.
+void arm_supervision_timer(void) {
+    if (supervision.fd < 0)
+        return;
+    double next = 0;
+    for (int i = 0; i < MAX_SUPERVISORS; i++) {
+        struct supervisor *sup = &supervision.entries[i];
+        if (sup->active && sup->pid == 0 && (next == 0 || sup->next_start < next))
+            next = sup->next_start;
+    }
+    struct itimerspec when;
+    memset(&when, 0, sizeof(when));
+    if (next > 0) {
+        when.it_value.tv_sec = (time_t)next;
+        when.it_value.tv_nsec = (long)((next - (time_t)next) * 1e9);
+    }
+    timerfd_settime(supervision.fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+//-------------------------------------------------------------
+// restart_due_supervised: Event handler for the restart timer: starts every supervised
+// command whose backoff has elapsed, then re-arms for the next one.
+void restart_due_supervised(int fd, short revents, void *arg) {
+    (void)revents;
+    (void)arg;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN)
+        return;
+    double now = now_seconds();
+    for (int i = 0; i < MAX_SUPERVISORS; i++) {
+        struct supervisor *sup = &supervision.entries[i];
+        if (sup->active && sup->pid == 0 && sup->next_start <= now)
+            start_supervised(sup);
     }
+    arm_supervision_timer();
 }